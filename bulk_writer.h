@@ -0,0 +1,167 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ios>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Последовательная запись больших бинарных файлов (index_native.bin).
+//
+// Мелкие поля (заголовок, DocMeta) копируются в выровненный буфер на
+// BULK_WRITER_BUF байт и уходят одним write(2); массивы не меньше половины
+// буфера пишутся напрямую из памяти вызывающего, без копии. iostream не
+// участвует. Интерфейс write(const char*, n) и operator bool совпадают с
+// std::ostream, поэтому шаблонные писатели секций работают с обоими.
+//
+// Ошибка ввода-вывода запоминается (error()); дальнейшие записи — no-op.
+//
+// seconds() / mb_per_s() — только время системных вызовов write/pwrite/close
+// и перенесённые ими байты; wall_seconds() — от open до close, включая
+// работу вызывающего между записями (слияние прогонов, кодирование).
+
+constexpr std::size_t BULK_WRITER_BUF   = std::size_t(4) << 20;
+constexpr std::size_t BULK_WRITER_ALIGN = 4096;
+
+class BulkWriter {
+public:
+    BulkWriter() = default;
+    BulkWriter(const BulkWriter&) = delete;
+    BulkWriter& operator=(const BulkWriter&) = delete;
+    ~BulkWriter() { std::string e; close(e); std::free(buf_); }
+
+    bool open(const std::string& path, std::string& err) {
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) { err = "cannot open " + path + " for write: " + std::strerror(errno); return false; }
+        if (!buf_) buf_ = (char*)std::aligned_alloc(BULK_WRITER_ALIGN, BULK_WRITER_BUF);
+        if (!buf_) { err = "out of memory"; return false; }
+        path_ = path;
+        used_ = 0;
+        offset_ = 0;
+        syscalls_ = 0;
+        written_  = 0;
+        seconds_  = 0.0;
+        wall_seconds_ = 0.0;
+        error_.clear();
+        t0_ = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    // Та же сигнатура, что у std::ostream::write.
+    void write(const char* p, std::streamsize sn) {
+        const std::size_t n = (std::size_t)sn;
+        if (!error_.empty() || n == 0) return;
+        if (n >= BULK_WRITER_BUF / 2) {
+            flush();
+            write_all(p, n);
+        } else {
+            if (used_ + n > BULK_WRITER_BUF) flush();
+            std::memcpy(buf_ + used_, p, n);
+            used_ += n;
+        }
+        offset_ += n;
+    }
+
+    template <class T>
+    void put(const T& v) { write((const char*)&v, (std::streamsize)sizeof(T)); }
+
+    // Нули до ближайшего смещения, кратного align.
+    void pad_to(std::uint64_t align) {
+        static const char zeros[64] = {};
+        while (offset_ % align != 0) {
+            const std::uint64_t n = std::min<std::uint64_t>(sizeof(zeros), align - offset_ % align);
+            write(zeros, (std::streamsize)n);
+        }
+    }
+
+    // Перезапись уже выданных байт (заголовок, известный только в конце).
+    void patch(std::uint64_t off, const void* p, std::size_t n) {
+        if (!error_.empty()) return;
+        flush();
+        const char* c = (const char*)p;
+        while (n > 0) {
+            const auto t = std::chrono::steady_clock::now();
+            const ssize_t w = ::pwrite(fd_, c, n, (off_t)off);
+            seconds_ += since(t);
+            syscalls_++;
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                error_ = "write failed: " + path_ + ": " + std::strerror(errno);
+                return;
+            }
+            written_ += (std::uint64_t)w;
+            c += w;
+            off += (std::uint64_t)w;
+            n -= (std::size_t)w;
+        }
+    }
+
+    std::uint64_t offset() const { return offset_; }
+    const std::string& error() const { return error_; }
+    explicit operator bool() const { return error_.empty() && fd_ >= 0; }
+
+    // Сбрасывает буфер и закрывает файл.
+    bool close(std::string& err) {
+        if (fd_ < 0) return error_.empty();
+        flush();
+        const auto t = std::chrono::steady_clock::now();
+        if (::close(fd_) != 0 && error_.empty()) error_ = "close failed: " + path_ + ": " + std::strerror(errno);
+        seconds_ += since(t);
+        fd_ = -1;
+        wall_seconds_ = since(t0_);
+        if (!error_.empty()) { err = error_; return false; }
+        return true;
+    }
+
+    std::uint64_t bytes() const { return offset_; }
+    std::uint64_t syscalls() const { return syscalls_; }
+    double seconds() const { return seconds_; }
+    double wall_seconds() const { return wall_seconds_; }
+    double mb_per_s() const { return seconds_ > 0 ? (double)written_ / (1 << 20) / seconds_ : 0.0; }
+
+private:
+    int           fd_       = -1;
+    char*         buf_      = nullptr;
+    std::size_t   used_     = 0;
+    std::uint64_t offset_   = 0;
+    std::uint64_t syscalls_ = 0;
+    std::uint64_t written_  = 0;     // байт, перенесённых write/pwrite
+    double        seconds_  = 0.0;   // в системных вызовах
+    double        wall_seconds_ = 0.0;
+    std::string   path_;
+    std::string   error_;
+    std::chrono::steady_clock::time_point t0_;
+
+    static double since(std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+    }
+
+    void flush() {
+        if (used_ == 0) return;
+        write_all(buf_, used_);
+        used_ = 0;
+    }
+
+    void write_all(const char* p, std::size_t n) {
+        while (n > 0 && error_.empty()) {
+            const auto t = std::chrono::steady_clock::now();
+            const ssize_t w = ::write(fd_, p, n);
+            seconds_ += since(t);
+            syscalls_++;
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                error_ = "write failed: " + path_ + ": " + std::strerror(errno);
+                return;
+            }
+            written_ += (std::uint64_t)w;
+            p += w;
+            n -= (std::size_t)w;
+        }
+    }
+};
@@ -4,14 +4,25 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <memory>
+#include <algorithm>
 #include <filesystem>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
 
 #include <dlfcn.h>
 #include <pqxx/pqxx>
 #include <nlohmann/json.hpp>
 
 #include "httplib.h"
+#include "text_common.h"
+#include "index_format.h"
+#include "postings_codec.h"
+#include "index_mmap.h"
+#include "index_segments.h"
 
 using json = nlohmann::json;
 namespace fs = std::filesystem;
@@ -78,6 +89,26 @@ static json db_upsert_doc(const json& body) {
     return json{{"ok", true}, {"doc_id", doc_id}};
 }
 
+// Мягкое удаление: документ уходит из полного корпуса, а дельта-сборка
+// (/v1/corpus/build с delta) выдаёт его tombstone'ом.
+static json db_delete_doc(const json& body) {
+    const std::string doc_id = body.value("doc_id", "");
+    if (doc_id.empty()) throw std::runtime_error("doc_id is required");
+
+    pqxx::connection c(pg_conninfo_from_env());
+    pqxx::work tx(c);
+    auto r = tx.exec_params(
+        "UPDATE core_documents SET status='deleted' WHERE doc_id=$1 AND status NOT IN ('deleted','purging')",
+        doc_id
+    );
+    tx.commit();
+    return json{{"ok", true}, {"doc_id", doc_id}, {"deleted", r.affected_rows() > 0}};
+}
+
+static fs::path tombstones_path_for(const fs::path& corpus_path) {
+    return fs::path(corpus_path.string() + ".tombstones");
+}
+
 static json db_build_corpus(const json& body) {
     fs::path corpus_path = env_req("CORPUS_JSONL");
     if (body.contains("corpus_path") && body["corpus_path"].is_string()) {
@@ -85,14 +116,30 @@ static json db_build_corpus(const json& body) {
     }
     fs::create_directories(corpus_path.parent_path());
 
+    // delta: только новые/изменённые документы (status='stored') и рядом
+    // список удалённых — вход для index_builder --segment --tombstones.
+    // Выгруженные строки в той же транзакции переходят в 'indexing' /
+    // 'purging': повторный upsert во время сборки вернёт 'stored', и
+    // mark_segment_indexed такую строку не тронет. Строки неудачной сборки
+    // остаются 'indexing' / 'purging' и попадают в следующую дельту.
+    const bool delta = body.value("delta", false);
+
     pqxx::connection c(pg_conninfo_from_env());
     pqxx::work tx(c);
 
-    auto r = tx.exec(
-        "SELECT doc_id, COALESCE(title,''), COALESCE(author,''), text_content "
-        "FROM core_documents "
-        "WHERE status IN ('stored','indexed') "
-        "ORDER BY id"
+    if (delta) {
+        tx.exec("UPDATE core_documents SET status='indexing' WHERE status='stored'");
+        tx.exec("UPDATE core_documents SET status='purging' WHERE status='deleted'");
+    }
+    auto r = tx.exec(delta
+        ? "SELECT doc_id, COALESCE(title,''), COALESCE(author,''), text_content "
+          "FROM core_documents "
+          "WHERE status='indexing' "
+          "ORDER BY id"
+        : "SELECT doc_id, COALESCE(title,''), COALESCE(author,''), text_content "
+          "FROM core_documents "
+          "WHERE status IN ('stored','indexing','indexed') "
+          "ORDER BY id"
     );
 
     std::ofstream out(corpus_path, std::ios::binary);
@@ -117,11 +164,112 @@ static json db_build_corpus(const json& body) {
         written++;
     }
 
+    json res{{"ok", true}, {"corpus_path", corpus_path.string()}, {"corpus_docs", written}};
+    if (delta) {
+        const fs::path tpath = tombstones_path_for(corpus_path);
+        std::ofstream tout(tpath);
+        if (!tout) throw std::runtime_error("cannot write tombstones: " + tpath.string());
+        int deleted = 0;
+        for (auto row : tx.exec("SELECT doc_id FROM core_documents WHERE status='purging' ORDER BY id")) {
+            tout << row[0].as<std::string>() << "\n";
+            deleted++;
+        }
+        res["delta"] = true;
+        res["tombstones"] = deleted;
+        res["tombstones_path"] = tpath.string();
+    }
+
     tx.commit();
-    return json{{"ok", true}, {"corpus_path", corpus_path.string()}, {"corpus_docs", written}};
+    return res;
 }
 
 // ---------------- index_builder runner ----------------
+
+// Документы дельты попали в сегмент, удалённые — в его tombstones.
+// Повышаются только строки, всё ещё помеченные выгрузкой (db_build_corpus).
+static void mark_segment_indexed(pqxx::work& tx, const fs::path& corpus_path, const fs::path& tombstones) {
+    std::ifstream in(corpus_path);
+    std::string line;
+    while (std::getline(in, line)) {
+        const json rec = json::parse(line, nullptr, false);
+        if (!rec.is_object() || !rec.contains("doc_id")) continue;
+        tx.exec_params("UPDATE core_documents SET status='indexed' WHERE doc_id=$1 AND status='indexing'",
+                       rec["doc_id"].get<std::string>());
+    }
+    std::ifstream tin(tombstones);
+    while (std::getline(tin, line)) {
+        if (line.empty()) continue;
+        tx.exec_params("UPDATE core_documents SET status='purged' WHERE doc_id=$1 AND status='purging'", line);
+    }
+}
+
+static std::string segment_merge_cmd(const fs::path& set_dir, bool all) {
+    const fs::path bin = env_req("INDEX_BUILDER_PATH");
+    std::ostringstream cmd;
+    cmd << bin.string() << " --merge " << set_dir.string() << (all ? " --all" : "");
+    // порог стоп-шинглов набора передаётся явно; --merge сверяет его с сегментами
+    std::string err;
+    SegmentManifest m;
+    SegmentBuildConfig cfg;
+    if (load_segment_manifest(set_dir, m, err) && !m.segments.empty() &&
+        read_segment_config(set_dir / m.segments.front().name, cfg, err)) {
+        if (cfg.df_max > 0) cmd << " --df-max " << cfg.df_max;
+        if (cfg.df_pct > 0) cmd << " --df-pct " << json(cfg.df_pct).dump();
+        if (cfg.df_side) cmd << " --df-side";
+    }
+    cmd << " > " << (set_dir / "merge.stdout.log").string()
+        << " 2> " << (set_dir / "merge.stderr.log").string();
+    return cmd.str();
+}
+
+// Фоновая компакция набора сегментов; одновременно — не больше одной.
+static std::atomic<bool> g_merge_running{false};
+
+static bool start_segment_merge(const fs::path& set_dir, bool all) {
+    bool expected = false;
+    if (!g_merge_running.compare_exchange_strong(expected, true)) return false;
+    const std::string cmd = segment_merge_cmd(set_dir, all);
+    std::thread([cmd] {
+        std::system(cmd.c_str());
+        g_merge_running = false;
+    }).detach();
+    return true;
+}
+
+// Синхронная компакция: дожидается фоновой и на время слияния занимает
+// тот же флаг, иначе одна из двух упадёт на "segment set changed".
+static int run_segment_merge(const fs::path& set_dir, bool all) {
+    bool expected = false;
+    while (!g_merge_running.compare_exchange_strong(expected, true)) {
+        expected = false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    const int rc = std::system(segment_merge_cmd(set_dir, all).c_str());
+    g_merge_running = false;
+    return rc;
+}
+
+static json api_index_merge(const json& body) {
+    fs::path set_dir = body.contains("index_dir")
+        ? fs::path(body["index_dir"].get<std::string>())
+        : fs::path(env_req("INDEX_ROOT")) / body.value("segment_set", std::string("segments"));
+    if (!is_segment_set(set_dir)) throw std::runtime_error("not a segment set: " + set_dir.string());
+    const bool all = body.value("all", false);
+
+    if (body.value("background", true)) {
+        const bool started = start_segment_merge(set_dir, all);
+        return json{{"ok", true}, {"started", started}, {"index_dir", set_dir.string()}};
+    }
+    const int rc = run_segment_merge(set_dir, all);
+    return json{
+        {"ok", rc == 0},
+        {"rc", rc},
+        {"index_dir", set_dir.string()},
+        {"stdout_log", (set_dir / "merge.stdout.log").string()},
+        {"stderr_log", (set_dir / "merge.stderr.log").string()}
+    };
+}
+
 static json run_index_builder(const json& body) {
     fs::path corpus_path = env_req("CORPUS_JSONL");
     if (body.contains("corpus_path")) corpus_path = body["corpus_path"].get<std::string>();
@@ -130,7 +278,10 @@ static json run_index_builder(const json& body) {
     std::string version = body.value("version", "");
     if (version.empty()) version = now_version_tag();
 
-    fs::path index_dir = index_root / version;
+    // segment: дельта дописывается сегментом в набор INDEX_ROOT/<segment_set>
+    const bool segment = body.value("segment", false);
+    fs::path index_dir = segment ? index_root / body.value("segment_set", std::string("segments"))
+                                 : index_root / version;
     fs::create_directories(index_dir);
 
     const fs::path bin = env_req("INDEX_BUILDER_PATH");
@@ -141,8 +292,64 @@ static json run_index_builder(const json& body) {
     fs::path errlog = index_dir / "build.stderr.log";
 
     std::ostringstream cmd;
-    cmd << bin.string() << " " << corpus_path.string() << " " << index_dir.string()
-        << " > " << outlog.string()
+    cmd << bin.string() << " " << corpus_path.string() << " " << index_dir.string();
+
+    const std::string norm = body.value("norm", "");
+    if (!norm.empty()) {
+        NormMode m;
+        if (!parse_norm_mode(norm, m)) throw std::runtime_error("bad norm: " + norm);
+        cmd << " --norm " << norm_mode_name(m);
+    }
+    const std::string hash = body.value("hash", "");
+    if (!hash.empty()) {
+        HashFamily f;
+        if (!parse_hash_family(hash, f)) throw std::runtime_error("bad hash: " + hash);
+        cmd << " --hash " << hash_family_name(f);
+    }
+    if (body.value("intern", false)) cmd << " --intern";
+    if (body.value("dedup", false))  cmd << " --dedup";
+    if (body.value("k13", false))    cmd << " --k13";
+    const int winnow = body.value("winnow", 0);
+    if (winnow < 0) throw std::runtime_error("bad winnow: " + std::to_string(winnow));
+    if (winnow > 0) cmd << " --winnow " << winnow;
+    const int sketch = body.value("sketch", 0);
+    if (sketch < 0) throw std::runtime_error("bad sketch: " + std::to_string(sketch));
+    if (sketch > 0) cmd << " --sketch " << sketch;
+    const int threads = body.value("threads", 0);
+    if (threads < 0) throw std::runtime_error("bad threads: " + std::to_string(threads));
+    if (threads > 0) cmd << " --threads " << threads;
+    const int mem_budget_mb = body.value("mem_budget_mb", 0);
+    if (mem_budget_mb < 0) throw std::runtime_error("bad mem_budget_mb: " + std::to_string(mem_budget_mb));
+    if (mem_budget_mb > 0) cmd << " --mem-budget " << mem_budget_mb;
+    const long long df_max = body.value("df_max", 0ll);
+    if (df_max < 0) throw std::runtime_error("bad df_max: " + std::to_string(df_max));
+    if (df_max > 0) cmd << " --df-max " << df_max;
+    const double df_pct = body.value("df_pct", 0.0);
+    if (df_pct < 0 || df_pct >= 100) throw std::runtime_error("bad df_pct: " + std::to_string(df_pct));
+    if (df_pct > 0) cmd << " --df-pct " << json(df_pct).dump();
+    const bool df_side = body.value("df_side", false);
+    if (df_side) cmd << " --df-side";
+    // дельта знает только свой df: без df_side отсечённое не вернуть слиянием
+    if (segment && (df_max > 0 || df_pct > 0) && !df_side)
+        throw std::runtime_error("segment build with df_max/df_pct requires df_side");
+    const std::string postings = body.value("postings", "");
+    if (!postings.empty()) {
+        std::uint32_t codec = 0;
+        if (!parse_postings_codec(postings, codec)) throw std::runtime_error("bad postings: " + postings);
+        cmd << " --postings " << postings_codec_name(codec);
+    }
+    const std::string format = body.value("format", "");
+    if (!format.empty()) {
+        if (format != "v1" && format != "v3") throw std::runtime_error("bad format: " + format);
+        cmd << " --format " << format;
+    }
+    const fs::path tombstones = tombstones_path_for(corpus_path);
+    if (segment) {
+        cmd << " --segment";
+        if (fs::exists(tombstones)) cmd << " --tombstones " << tombstones.string();
+    }
+
+    cmd << " > " << outlog.string()
         << " 2> " << errlog.string();
 
     int rc = std::system(cmd.str().c_str());
@@ -160,9 +367,10 @@ static json run_index_builder(const json& body) {
         (rc == 0 ? "built" : "failed"),
         json{{"rc", rc}}.dump()
     );
+    if (segment && rc == 0) mark_segment_indexed(tx, corpus_path, tombstones);
     tx.commit();
 
-    return json{
+    json res{
         {"ok", rc == 0},
         {"rc", rc},
         {"version", version},
@@ -170,6 +378,8 @@ static json run_index_builder(const json& body) {
         {"stdout_log", outlog.string()},
         {"stderr_log", errlog.string()}
     };
+    if (segment && rc == 0 && body.value("merge", true)) res["merge_started"] = start_segment_merge(index_dir, false);
+    return res;
 }
 
 // ---------------- libsearchcore.so bindings ----------------
@@ -186,14 +396,51 @@ struct SeSearchResult { int count; };
 
 using fn_se_load_index  = int(*)(const char*);
 using fn_se_search_text = SeSearchResult(*)(const char*, int, SeHit*, int);
+using fn_se_query_params = void(*)(IndexParams*);   // опционально
+using fn_se_load_segments = int(*)(const char* const*, int);   // опционально: набор сегментов
 
 static void* g_lib = nullptr;
-static fn_se_load_index  g_load = nullptr;
-static fn_se_search_text g_search = nullptr;
+static fn_se_load_index   g_load = nullptr;
+static fn_se_search_text  g_search = nullptr;
+static fn_se_query_params g_query_params = nullptr;
+static fn_se_load_segments g_load_segments = nullptr;
+
+// Загруженный индекс по частям: обычный индекс — одна часть, набор
+// сегментов — по части на сегмент; doc_id_int ядра — сквозной номер.
+struct LoadedPart {
+    std::uint32_t base   = 0;   // сквозной номер первого документа
+    std::uint32_t n_docs = 0;
+    std::unique_ptr<MappedDocIds>  ids;        // index_native_docids.bin
+    std::vector<std::string>       ids_json;   // индексы без него
+    std::unique_ptr<MappedDocMeta> meta;       // index_native_meta.bin, если есть
+
+    std::string_view doc_id(std::uint32_t i) const { return ids ? ids->id(i) : std::string_view(ids_json[i]); }
+};
+
+struct LoadedIndex {
+    fs::path index_dir;
+    std::vector<LoadedPart> parts;
+    std::uint32_t n_docs = 0;
+    std::vector<std::uint8_t> doc_live;   // набор сегментов: 0 — заменён или удалён
+    MappedIndex map;                      // v3: отображение index_native.bin
+
+    const LoadedPart* part_of(std::uint32_t di, std::uint32_t& local) const {
+        auto it = std::upper_bound(parts.begin(), parts.end(), di,
+                                   [](std::uint32_t d, const LoadedPart& p) { return d < p.base; });
+        if (it == parts.begin()) return nullptr;
+        --it;
+        local = di - it->base;
+        return local < it->n_docs ? &*it : nullptr;
+    }
+};
 
-static bool g_loaded = false;
-static fs::path g_current_index_dir;
-static std::vector<std::string> g_doc_ids;
+// /v1/index/load собирает LoadedIndex в стороне (g_load_mu — одна загрузка
+// за раз) и подменяет g_index вместе с загрузкой ядра под g_index_mu;
+// поиск держит g_index_mu разделяемо, пока читает ядро и части. Ошибка
+// загрузки оставляет прежний индекс.
+static std::mutex g_load_mu;
+static std::shared_mutex g_index_mu;
+static std::unique_ptr<LoadedIndex> g_index;
 
 static std::string read_file(const fs::path& p) {
     std::ifstream f(p, std::ios::binary);
@@ -213,13 +460,125 @@ static void ensure_core_loaded() {
     g_search = (fn_se_search_text)dlsym(g_lib, "se_search_text");
     if (!g_load || !g_search)
         throw std::runtime_error("dlsym failed: missing se_load_index/se_search_text");
+
+    // старые сборки ядра не экспортируют se_query_params: они хэшируют
+    // запросы параметрами по умолчанию (ascii + fnv1a64)
+    g_query_params = (fn_se_query_params)dlsym(g_lib, "se_query_params");
+    // se_load_index_segments(dirs, n): doc_id_int в выдаче — сквозной номер по
+    // сегментам в порядке набора; без него набор перед загрузкой сливается в один
+    g_load_segments = (fn_se_load_segments)dlsym(g_lib, "se_load_index_segments");
+}
+
+static IndexParams core_query_params() {
+    IndexParams p;
+    if (g_query_params) g_query_params(&p);
+    return p;
 }
 
-static void load_docids(const fs::path& index_dir) {
-    fs::path p = index_dir / "index_native_docids.json";
-    std::string s = read_file(p);
-    if (s.empty()) throw std::runtime_error("missing index_native_docids.json in " + index_dir.string());
-    g_doc_ids = json::parse(s).get<std::vector<std::string>>();
+static IndexHeader read_index_header_file(const fs::path& index_dir) {
+    fs::path p = index_dir / "index_native.bin";
+    std::ifstream f(p, std::ios::binary);
+    if (!f) throw std::runtime_error("missing index_native.bin in " + index_dir.string());
+
+    IndexHeader h;
+    std::string err;
+    if (!read_index_header(f, h, err)) throw std::runtime_error("index_native.bin: " + err);
+    return h;
+}
+
+// doc id и метаданные каталога индекса. doc id отображаются из
+// index_native_docids.bin; индексы, собранные до него, читаются из секции
+// doc_ids (v3) или index_native_docids.json. index_native_meta.bin
+// необязателен: без него выдача без title/author.
+static void load_part(LoadedIndex& ix, const fs::path& index_dir, std::uint32_t n_docs, const MappedIndex* v3) {
+    LoadedPart part;
+    part.base   = ix.n_docs;
+    part.n_docs = n_docs;
+    std::string err;
+
+    const fs::path ids_path = index_dir / "index_native_docids.bin";
+    if (fs::exists(ids_path)) {
+        part.ids = std::make_unique<MappedDocIds>();
+        if (!part.ids->open(ids_path.string(), err)) throw std::runtime_error(ids_path.string() + ": " + err);
+        if (part.ids->n_docs() != n_docs) throw std::runtime_error(ids_path.string() + ": doc count mismatch");
+    } else if (v3) {
+        part.ids_json.resize(n_docs);
+        for (std::uint32_t i = 0; i < n_docs; ++i) part.ids_json[i].assign(v3->doc_id(i));
+    } else {
+        const fs::path p = index_dir / "index_native_docids.json";
+        std::string s = read_file(p);
+        if (s.empty()) throw std::runtime_error("missing index_native_docids.json in " + index_dir.string());
+        part.ids_json = json::parse(s).get<std::vector<std::string>>();
+        if (part.ids_json.size() != n_docs) throw std::runtime_error(p.string() + ": doc count mismatch");
+    }
+
+    const fs::path meta_path = index_dir / "index_native_meta.bin";
+    if (fs::exists(meta_path)) {
+        part.meta = std::make_unique<MappedDocMeta>();
+        if (!part.meta->open(meta_path.string(), err)) throw std::runtime_error(meta_path.string() + ": " + err);
+        if (part.meta->n_docs() != n_docs) throw std::runtime_error(meta_path.string() + ": doc count mismatch");
+    }
+
+    ix.n_docs += n_docs;
+    ix.parts.push_back(std::move(part));
+}
+
+// Набор сегментов как один индекс: параметры всех сегментов совпадают,
+// doc id идут подряд по сегментам, заменённые и удалённые помечены в
+// doc_live и отсекаются в выдаче. Ядро не трогается: каталоги сегментов
+// для него — в dirs.
+static IndexHeader load_segment_set(LoadedIndex& ix, const fs::path& set_dir, std::vector<std::string>& dirs,
+                                    SegmentBuildConfig& cfg) {
+    std::string err;
+    SegmentManifest m;
+    if (!load_segment_manifest(set_dir, m, err)) throw std::runtime_error(err);
+    if (m.segments.size() > 1 && !g_load_segments) {
+        const int rc = run_segment_merge(set_dir, true);
+        if (rc != 0) throw std::runtime_error("segment merge failed rc=" + std::to_string(rc));
+        if (!load_segment_manifest(set_dir, m, err)) throw std::runtime_error(err);
+    }
+    if (m.segments.empty()) throw std::runtime_error("empty segment set: " + set_dir.string());
+
+    IndexHeader hdr;
+    std::vector<std::uint32_t> seg_docs;
+    for (std::size_t s = 0; s < m.segments.size(); ++s) {
+        const fs::path dir = set_dir / m.segments[s].name;
+        IndexHeader h;
+        SegmentBuildConfig c;
+        if (!read_segment_header(dir, h, err) || !read_segment_config(dir, c, err)) throw std::runtime_error(err);
+        if (s == 0) {
+            hdr = h;
+            cfg = c;
+        } else if (!check_segment_compat(hdr.params, h.params, err) || !check_segment_config(cfg, c, err)) {
+            throw std::runtime_error(m.segments[s].name + ": " + err);
+        }
+        dirs.push_back(dir.string());
+        seg_docs.push_back(h.n_docs);
+    }
+    if (!check_query_compat(hdr.params, core_query_params(), err))
+        throw std::runtime_error("index incompatible with search core: " + err);
+
+    for (std::size_t s = 0; s < dirs.size(); ++s) load_part(ix, dirs[s], seg_docs[s], nullptr);
+
+    // живость: обратным поиском по отображённым таблицам; сегменты без
+    // index_native_docids.bin — через множество всех id
+    std::vector<std::vector<std::uint8_t>> live;
+    const bool mapped = std::all_of(ix.parts.begin(), ix.parts.end(), [](const LoadedPart& p) { return p.ids != nullptr; });
+    if (mapped) {
+        std::vector<const MappedDocIds*> ids;
+        std::vector<std::vector<std::string>> tombstones(dirs.size());
+        for (std::size_t s = 0; s < dirs.size(); ++s) {
+            ids.push_back(ix.parts[s].ids.get());
+            if (!read_segment_tombstones(dirs[s], tombstones[s], err)) throw std::runtime_error(err);
+        }
+        mark_segment_live(ids, tombstones, live);
+    } else {
+        std::vector<SegmentDocs> sdocs;
+        if (!load_segment_docs(set_dir, m, sdocs, err)) throw std::runtime_error(err);
+        for (auto& sd : sdocs) live.push_back(std::move(sd.live));
+    }
+    for (const auto& l : live) ix.doc_live.insert(ix.doc_live.end(), l.begin(), l.end());
+    return hdr;
 }
 
 static json api_index_load(const json& body) {
@@ -238,19 +597,68 @@ static json api_index_load(const json& body) {
         index_dir = cur;
     }
 
-    int rc = g_load(index_dir.string().c_str());
-    if (rc != 0) throw std::runtime_error("se_load_index failed rc=" + std::to_string(rc));
-
-    load_docids(index_dir);
+    std::lock_guard<std::mutex> load_lk(g_load_mu);
+    std::string err;
+    IndexHeader hdr;
+    SegmentBuildConfig cfg;
+    auto ix = std::make_unique<LoadedIndex>();
+    ix->index_dir = index_dir;
+    std::vector<std::string> dirs;   // набор сегментов
+    const bool segments = is_segment_set(index_dir);
+    if (segments) {
+        hdr = load_segment_set(*ix, index_dir, dirs, cfg);
+    } else {
+        hdr = read_index_header_file(index_dir);
+        if (!read_segment_config(index_dir, cfg, err)) throw std::runtime_error(err);
+        if (!check_query_compat(hdr.params, core_query_params(), err))
+            throw std::runtime_error("index incompatible with search core: " + err);
+
+        // v3: каталог секций проверяется при отображении
+        if (hdr.version == INDEX_VERSION_V3) {
+            if (!ix->map.open((index_dir / "index_native.bin").string(), err, body.value("verify", false)))
+                throw std::runtime_error("index_native.bin: " + err);
+        }
+        load_part(*ix, index_dir, hdr.n_docs, hdr.version == INDEX_VERSION_V3 ? &ix->map : nullptr);
+    }
 
-    g_current_index_dir = index_dir;
-    g_loaded = true;
+    json res{
+        {"ok", true},
+        {"index_dir", index_dir.string()},
+        {"doc_ids", (int)ix->n_docs},
+        {"index_version", hdr.version},
+        {"norm", norm_mode_name((NormMode)hdr.params.norm_mode)},
+        {"hash", hash_family_name((HashFamily)hdr.params.hash_family)},
+        {"winnow_w", hdr.params.winnow_w},
+        {"sketch_k", hdr.params.sketch_k},
+        {"postings", postings_codec_name(hdr.params.postings_codec)},
+        {"dedup", hdr.params.dedup != 0},
+        {"k13", cfg.k13},
+        {"sections", (int)ix->map.sections().size()},
+        {"doc_meta", std::any_of(ix->parts.begin(), ix->parts.end(), [](const LoadedPart& p) { return p.meta != nullptr; })},
+        {"segments", (int)dirs.size()}
+    };
 
-    return json{{"ok", true}, {"index_dir", index_dir.string()}, {"doc_ids", (int)g_doc_ids.size()}};
+    // ядро и части подменяются вместе: поиск видит либо старый индекс, либо новый
+    std::unique_lock<std::shared_mutex> lk(g_index_mu);
+    int rc = 0;
+    if (!segments) {
+        rc = g_load(index_dir.string().c_str());
+    } else if (dirs.size() == 1) {
+        rc = g_load(dirs[0].c_str());
+    } else {
+        std::vector<const char*> ptrs;
+        for (const auto& d : dirs) ptrs.push_back(d.c_str());
+        rc = g_load_segments(ptrs.data(), (int)ptrs.size());
+    }
+    if (rc != 0) throw std::runtime_error("se_load_index failed rc=" + std::to_string(rc));
+    g_index = std::move(ix);
+    return res;
 }
 
 static json api_search(const json& body) {
-    if (!g_loaded) throw std::runtime_error("index not loaded");
+    std::shared_lock<std::shared_mutex> lk(g_index_mu);
+    if (!g_index) throw std::runtime_error("index not loaded");
+    const LoadedIndex& ix = *g_index;
 
     std::string q = body.value("q", "");
     int top = body.value("top", 10);
@@ -265,17 +673,26 @@ static json api_search(const json& body) {
     json docs = json::array();
     for (int i = 0; i < n; ++i) {
         int di = hits[i].doc_id_int;
-        if (di < 0 || di >= (int)g_doc_ids.size()) continue;
+        std::uint32_t local = 0;
+        const LoadedPart* part = di < 0 ? nullptr : ix.part_of((std::uint32_t)di, local);
+        if (!part) continue;
+        if (!ix.doc_live.empty() && !ix.doc_live[di]) continue;
 
-        docs.push_back(json{
-            {"doc_id", g_doc_ids[di]},
+        json d{
+            {"doc_id", std::string(part->doc_id(local))},
             {"score", hits[i].score},
             {"J9", hits[i].j9},
             {"C9", hits[i].c9},
             {"J13", hits[i].j13},
             {"C13", hits[i].c13},
             {"cand_hits", hits[i].cand_hits}
-        });
+        };
+        if (const MappedDocMeta* dm = part->meta.get()) {
+            d["title"]   = std::string(dm->title(local));
+            d["author"]  = std::string(dm->author(local));
+            d["tok_len"] = dm->tok_len(local);
+        }
+        docs.push_back(std::move(d));
     }
 
     return json{{"hits_total", (int)docs.size()}, {"documents", docs}};
@@ -320,6 +737,11 @@ int main() {
         catch (const std::exception& e) { fail(res, e.what()); }
     });
 
+    svr.Post("/v1/docs/delete", [&](const httplib::Request& req, httplib::Response& res) {
+        try { ok(res, db_delete_doc(parse_json_body(req))); }
+        catch (const std::exception& e) { fail(res, e.what()); }
+    });
+
     svr.Post("/v1/corpus/build", [&](const httplib::Request& req, httplib::Response& res) {
         try { ok(res, db_build_corpus(parse_json_body(req))); }
         catch (const std::exception& e) { fail(res, e.what()); }
@@ -341,6 +763,11 @@ int main() {
         }
     });
 
+    svr.Post("/v1/index/merge", [&](const httplib::Request& req, httplib::Response& res) {
+        try { ok(res, api_index_merge(parse_json_body(req))); }
+        catch (const std::exception& e) { fail(res, e.what()); }
+    });
+
     svr.Post("/v1/index/set_current", [&](const httplib::Request& req, httplib::Response& res) {
         try { ok(res, api_set_current(parse_json_body(req))); }
         catch (const std::exception& e) { fail(res, e.what()); }
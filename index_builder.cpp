@@ -6,24 +6,52 @@
 #include <cstdint>
 #include <algorithm>
 #include <filesystem>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
 
 #include <nlohmann/json.hpp>
 #include "text_common.h"
+#include "index_format.h"
+#include "token_dict.h"
+#include "postings_sort.h"
+#include "bulk_writer.h"
+#include "postings_codec.h"
+#include "index_mmap.h"
+#include "index_segments.h"
+#include "jsonl_scan.h"
 
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 
 namespace {
 
-constexpr int K = 9;
+constexpr int K   = 9;
+constexpr int K13 = 13;   // --k13: вторая ширина (N_post13)
+// Нижняя граница порога df: хэши с df 2-3 — как раз общие фрагменты пар
+// документов, ради которых строится индекс.
+constexpr std::uint32_t DF_MIN_THRESHOLD = 3;
 constexpr std::uint32_t MAX_TOKENS_PER_DOC   = 100000;  // 0 = без лимита
 constexpr std::uint32_t MAX_SHINGLES_PER_DOC = 50000;   // 0 = без лимита
 constexpr int SHINGLE_STRIDE = 1;
 
+// Батч для воркера: до BATCH_MAX_LINES строк или BATCH_MAX_BYTES байт.
+constexpr std::size_t BATCH_MAX_LINES = 256;
+constexpr std::size_t BATCH_MAX_BYTES = 4u << 20;
+// Отображённый корпус режется на диапазоны по CORPUS_CHUNK_BYTES.
+constexpr std::size_t CORPUS_CHUNK_BYTES = 1u << 20;
+
 struct DocMeta {
     std::uint32_t tok_len;
     std::uint64_t simhash_hi;
     std::uint64_t simhash_lo;
+    std::uint32_t uniq_shingles;   // --dedup: различных шинглов в постингах документа
 };
 
 struct DocInfo {
@@ -32,9 +60,96 @@ struct DocInfo {
     std::string author;
 };
 
-static bool parse_line_json(const std::string& line, DocInfo& info, std::string& text) {
+struct BuildOptions {
+    TextParams tp;
+    bool intern  = false;
+    int winnow_w = 0;
+    int sketch_k = 0;
+    std::uint64_t mem_budget = 0;   // --mem-budget, байт; 0 — все постинги в памяти
+    std::uint32_t postings_codec = POSTINGS_CODEC_RAW;
+    bool dedup = false;   // --dedup: (hash, doc) без повторов внутри документа
+    std::uint32_t layout = INDEX_LAYOUT_RECORDS;   // --format v3: INDEX_LAYOUT_MMAP
+    bool meta_json = false;   // --meta-json: docs_meta в index_native_meta.json
+    bool docids_json = false; // --docids-json: ещё и index_native_docids.json
+    bool k13 = false;   // --k13: постинги и по 13-граммам, тем же проходом
+    std::uint32_t df_max = 0;   // --df-max N: хэши с df > N — стоп-шинглы
+    double df_pct = 0;          // --df-pct P: хэши в более чем P% документов
+    bool df_side = false;       // --df-side: стоп-шинглы в stop_postings (v3), а не выброшены
+
+    bool df_prune() const { return df_max > 0 || df_pct > 0; }
+};
+
+// Рабочие буферы одного потока, переиспользуются между документами.
+struct DocScratch {
+    std::vector<std::uint64_t> tok_hashes;
+    std::vector<TokenSpan>     tok_spans;
+    std::vector<std::uint32_t> tok_ids;
+    TokenDict                  batch_dict;   // --intern: словарь батча, локальные id
+    std::vector<std::uint32_t> batch_ids;    // локальные id токенов документов батча подряд
+    std::vector<std::size_t>   batch_off;    // docs + 1
+    std::vector<std::uint32_t> to_global;    // локальный id -> id общего словаря
+    std::vector<std::uint64_t> sh_hashes;
+    std::vector<std::uint64_t> sh_hashes13;
+    std::vector<std::uint32_t> win_sel;
+    std::vector<std::uint32_t> win_scratch;
+    std::vector<std::uint64_t> sketch_heap;
+    ShingleDedupSet            dedup;
+    JsonlScanBuffers           json;   // строки с escape и текст из запасного разбора
+};
+
+// Подряд идущие строки JSONL; seq — номер батча в порядке чтения.
+// Корпус, прочитанный потоком, приходит строками (lines); отображённый в
+// память — байтовым диапазоном [begin, end) без копий.
+struct Batch {
+    std::uint64_t seq = 0;
+    std::vector<std::string> lines;
+
+    const char* corpus = nullptr;   // mmap: весь корпус
+    std::size_t corpus_size = 0;
+    std::size_t begin = 0;
+    std::size_t end   = 0;
+};
+
+// Строки батча. В диапазоне — строки, которые в нём начинаются: хвост
+// строки из предыдущего диапазона пропускается до '\n', последняя строка
+// дочитывается за end. Пустые строки пропускаются, как в read_batches.
+template <class F>
+static void for_each_line(const Batch& b, F&& f) {
+    if (!b.corpus) {
+        for (const std::string& line : b.lines) f(std::string_view(line));
+        return;
+    }
+    const char* file_end  = b.corpus + b.corpus_size;
+    const char* range_end = b.corpus + b.end;
+    const char* p = b.corpus + b.begin;
+    if (b.begin > 0 && p[-1] != '\n') {
+        const char* nl = (const char*)std::memchr(p, '\n', (std::size_t)(file_end - p));
+        p = nl ? nl + 1 : file_end;
+    }
+    while (p < range_end) {
+        const char* nl = (const char*)std::memchr(p, '\n', (std::size_t)(file_end - p));
+        const char* e  = nl ? nl : file_end;
+        if (e > p) f(std::string_view(p, (std::size_t)(e - p)));
+        p = nl ? nl + 1 : file_end;
+    }
+}
+
+// Результат батча. doc в postings — локальный индекс внутри батча:
+// глобальный doc_idx назначается при коммите в порядке seq.
+struct BatchOut {
+    std::vector<DocMeta>       docs;
+    std::vector<DocInfo>       infos;
+    std::vector<PackedPosting> postings;
+    std::vector<PackedPosting> postings13;   // --k13
+    std::vector<std::uint64_t> sketches;
+
+    std::uint64_t skipped_bad_json = 0;
+    std::uint64_t skipped_bad_doc  = 0;
+};
+
+static bool parse_line_json(std::string_view line, DocInfo& info, std::string& text) {
     try {
-        auto j = json::parse(line);
+        auto j = json::parse(line.begin(), line.end());
         if (!j.is_object()) return false;
 
         info.doc_id = j.value("doc_id", ""); // ВАЖНО: doc_id (а не "doc_id"/"document_id" вперемешку)
@@ -51,187 +166,1529 @@ static bool parse_line_json(const std::string& line, DocInfo& info, std::string&
     }
 }
 
-} // namespace
+// Поля строки корпуса. Обычно — jsonl_scan_doc без DOM: text указывает прямо
+// в line (или в sc.json, если в нём есть escape). Что сканер не взялся
+// разобрать, разбирает nlohmann — с тем же результатом, что и раньше.
+static bool parse_line(std::string_view line, DocScratch& sc, DocInfo& info, std::string_view& text) {
+    JsonlDocFields f;
+    if (jsonl_scan_doc(line, f, sc.json)) {
+        if (f.doc_id.empty() || f.text.empty()) return false;
+        info.doc_id.assign(f.doc_id);
+        info.title.assign(f.title);
+        info.author.assign(f.author);
+        text = f.text;
+        return true;
+    }
+    if (!parse_line_json(line, info, sc.json.text)) return false;
+    text = sc.json.text;
+    return true;
+}
 
-int main(int argc, char** argv) {
-    if (argc < 3) {
-        std::cerr << "Usage: index_builder <corpus_jsonl> <out_dir>\n";
-        return 1;
+// Шинглы документа doc -> постинги и bottom-k скетч (по K = 9).
+// tok_ids != nullptr: шинглы по id токенов (--intern), иначе по хэшам.
+// С --k13 те же позиции дают и 13-граммы: по хэшам токенов hash_shingles
+// продолжает свёртку 9-граммы ещё на 4 токена (обе ширины одним проходом),
+// по id (--intern) hash_shingles_ids считает 13-граммы заново вторым проходом.
+// Возвращает число выданных postings9 (с --dedup — различных шинглов).
+static std::uint32_t emit_doc_shingles(
+    const BuildOptions& opt,
+    DocScratch& sc,
+    const std::uint64_t* tok_hashes,
+    const std::uint32_t* tok_ids,
+    std::size_t n_tok,
+    std::uint32_t doc,
+    std::vector<PackedPosting>& postings,
+    std::vector<PackedPosting>& postings13,
+    std::vector<std::uint64_t>& sketches
+) {
+    const int cnt  = (int)n_tok - K + 1;
+    const int step = (SHINGLE_STRIDE > 0 ? SHINGLE_STRIDE : 1);
+    const std::uint32_t max_sh =
+        (MAX_SHINGLES_PER_DOC > 0) ? MAX_SHINGLES_PER_DOC : (std::uint32_t)cnt;
+
+    // позиции 0, step, 2*step, ... — не больше max_sh штук
+    const std::size_t need_pos = std::min<std::size_t>(
+        (std::size_t)cnt, (std::size_t)(max_sh - 1) * step + 1);
+    auto& sh_hashes = sc.sh_hashes;
+    sh_hashes.resize(need_pos);
+    const std::size_t need13 = opt.k13 ? std::min(need_pos, shingle_count(n_tok, K13)) : 0;
+    sc.sh_hashes13.resize(need13);
+    std::uint64_t* out13 = need13 > 0 ? sc.sh_hashes13.data() : nullptr;
+    if (tok_ids) hash_shingles_ids(tok_ids, n_tok, need_pos, K, sh_hashes.data(), K13, out13);
+    else         hash_shingles(tok_hashes, n_tok, need_pos, K, sh_hashes.data(), K13, out13);
+
+    if (opt.sketch_k > 0) {
+        sketches.resize(sketches.size() + (std::size_t)opt.sketch_k);
+        bottomk_sketch(sh_hashes.data(), need_pos, opt.sketch_k,
+                       sketches.data() + sketches.size() - opt.sketch_k, sc.sketch_heap);
     }
 
-    const fs::path corpus_path = argv[1];
-    const fs::path out_dir     = argv[2];
+    // выбор позиций (winnowing, stride) и --dedup — отдельно для каждой ширины
+    auto emit_width = [&](const std::uint64_t* sh, std::size_t n, std::vector<PackedPosting>& out) {
+        const std::size_t before = out.size();
+        if (opt.dedup) sc.dedup.begin(n);
+        auto emit = [&](std::uint64_t h) {
+            if (!opt.dedup || sc.dedup.insert(h)) out.push_back({h, doc});
+        };
+        if (opt.winnow_w > 0) {
+            const std::size_t n_sel =
+                winnow_positions(sh, n, opt.winnow_w, sc.win_sel, sc.win_scratch);
+            for (std::size_t k = 0; k < n_sel; ++k) emit(sh[sc.win_sel[k]]);
+        } else {
+            for (std::size_t pos = 0; pos < n; pos += step) emit(sh[pos]);
+        }
+        return (std::uint32_t)(out.size() - before);
+    };
+    const std::uint32_t n9 = emit_width(sh_hashes.data(), need_pos, postings);
+    if (need13 > 0) emit_width(sc.sh_hashes13.data(), need13, postings13);
+    return n9;
+}
 
-    std::ifstream in(corpus_path);
-    if (!in) {
-        std::cerr << "cannot open " << corpus_path << "\n";
-        return 1;
+// --intern: id токенов зависят от порядка документов. Воркер интернирует
+// батч в свой словарь, а в общий словарь батчи сливаются строго по seq —
+// короткий шаг по словарю батча, а не по тексту. Шинглы по id и скетчи
+// воркер считает уже сам.
+class TokenIdAssigner {
+public:
+    explicit TokenIdAssigner(TokenDict& dict) : dict_(dict) {}
+
+    // Каждый seq вызывается ровно один раз, в том числе для пустого батча.
+    void assign(std::uint64_t seq, const TokenDict& batch, std::vector<std::uint32_t>& to_global) {
+        std::unique_lock<std::mutex> lk(m_);
+        cv_.wait(lk, [&] { return next_ == seq; });
+        dict_.merge(batch, to_global);
+        ++next_;
+        cv_.notify_all();
     }
-    fs::create_directories(out_dir);
 
-    std::vector<DocMeta> docs;
-    std::vector<DocInfo> infos;
-    std::vector<std::pair<std::uint64_t, std::uint32_t>> postings9;
+private:
+    TokenDict&              dict_;
+    std::mutex              m_;
+    std::condition_variable cv_;
+    std::uint64_t           next_ = 0;
+};
 
-    docs.reserve(1024);
-    infos.reserve(1024);
-    postings9.reserve(1024 * 64);
+// Стадия воркера: parse / normalize / hash / simhash / шинглы. С --intern
+// между токенизацией и шинглами — слияние словаря батча (ids).
+static void process_batch(const BuildOptions& opt, Batch& batch, DocScratch& sc, BatchOut& out, TokenIdAssigner* ids) {
+    if (opt.intern) {
+        sc.batch_dict.clear();
+        sc.batch_ids.clear();
+        sc.batch_off.assign(1, 0);
+    }
 
-    std::vector<TokenSpan> spans;
-    spans.reserve(256);
+    for_each_line(batch, [&](std::string_view line) {
+        DocInfo info;
+        std::string_view text;
+        if (!parse_line(line, sc, info, text)) {
+            out.skipped_bad_json++;
+            return;
+        }
+
+        const std::size_t n_tok =
+            hash_tokens_fused(text.data(), text.size(), sc.tok_hashes,
+                              opt.intern ? &sc.tok_spans : nullptr, MAX_TOKENS_PER_DOC, opt.tp);
+        if (n_tok < (std::size_t)K) { out.skipped_bad_doc++; return; }
+
+        auto [hi, lo] = simhash128_token_hashes(sc.tok_hashes.data(), n_tok);
+
+        DocMeta dm{};
+        dm.tok_len    = (std::uint32_t)n_tok;
+        dm.simhash_hi = hi;
+        dm.simhash_lo = lo;
+
+        const std::uint32_t local = (std::uint32_t)out.docs.size();
+        out.docs.push_back(dm);
+        out.infos.push_back(std::move(info));
+
+        if (opt.intern) {
+            sc.batch_dict.intern_doc(local, text.data(), sc.tok_hashes.data(), sc.tok_spans.data(),
+                                     n_tok, opt.tp.norm, sc.tok_ids);
+            sc.batch_ids.insert(sc.batch_ids.end(), sc.tok_ids.begin(), sc.tok_ids.end());
+            sc.batch_off.push_back(sc.batch_ids.size());
+        } else {
+            out.docs[local].uniq_shingles =
+                emit_doc_shingles(opt, sc, sc.tok_hashes.data(), nullptr, n_tok, local,
+                                  out.postings, out.postings13, out.sketches);
+        }
+    });
+    batch.lines.clear();
+    if (!opt.intern) return;
+
+    ids->assign(batch.seq, sc.batch_dict, sc.to_global);
+    for (std::size_t d = 0; d < out.docs.size(); ++d) {
+        const std::size_t off = sc.batch_off[d];
+        const std::size_t n   = sc.batch_off[d + 1] - off;
+        sc.tok_ids.resize(n);
+        for (std::size_t t = 0; t < n; ++t) sc.tok_ids[t] = sc.to_global[sc.batch_ids[off + t]];
+        out.docs[d].uniq_shingles =
+            emit_doc_shingles(opt, sc, nullptr, sc.tok_ids.data(), n, (std::uint32_t)d,
+                              out.postings, out.postings13, out.sketches);
+    }
+}
+
+// Документная частота хэшей списка (--df-max / --df-pct); df — число разных
+// doc у хэша. Гистограмма по степеням двойки: корзина b — хэши с df в
+// [2^b, 2^(b+1)) и их постинги.
+struct DfStats {
+    std::uint32_t threshold = 0;   // df > threshold — стоп-шингл; 0 — без отсечения
+    std::uint64_t hashes          = 0;
+    std::uint64_t pruned_hashes   = 0;
+    std::uint64_t pruned_postings = 0;
+    std::vector<std::uint64_t> hist_hashes;
+    std::vector<std::uint64_t> hist_postings;
+    std::vector<std::uint64_t> stop_hashes;   // отсекаемые хэши по возрастанию (count_df)
+};
+
+// Постинги одной ширины: буфер в памяти и (--mem-budget) отсортированные
+// прогоны на диске.
+struct PostingList {
+    std::vector<PackedPosting> recs;
+    std::vector<PackedPosting> sort_tmp;   // буфер radix-сортировки
+    std::vector<std::string>   run_paths;
+    std::uint64_t              n_spilled = 0;
+    const char*                run_prefix;   // имя прогонов в spill_runs
+    DfStats                    df;
+    std::string                stop_path;    // --df-side: отсечённые постинги, сырой прогон
+
+    explicit PostingList(const char* prefix) : run_prefix(prefix) {}
+    std::uint64_t size() const { return n_spilled + (std::uint64_t)recs.size(); }
+};
+
+// Глобальное состояние сборки; пополняется батчами строго в порядке seq.
+struct BuildState {
+    std::vector<DocMeta>       docs;
+    std::vector<DocInfo>       infos;
+    PostingList                post9{"run"};
+    PostingList                post13{"run13"};   // --k13
+    std::vector<std::uint64_t> sketches;   // --sketch: N_docs * sketch_k
+    TokenDict                  dict;       // --intern: словарь токенов, шинглы по u32 id
 
     std::uint64_t skipped_bad_json = 0;
     std::uint64_t skipped_bad_doc  = 0;
+};
+
+static void commit_batch(BatchOut& out, BuildState& st) {
+    const std::uint32_t base = (std::uint32_t)st.docs.size();
+    st.skipped_bad_json += out.skipped_bad_json;
+    st.skipped_bad_doc  += out.skipped_bad_doc;
+
+    for (const auto& p : out.postings) st.post9.recs.push_back({p.hash, base + p.doc});
+    for (const auto& p : out.postings13) st.post13.recs.push_back({p.hash, base + p.doc});
+    st.sketches.insert(st.sketches.end(), out.sketches.begin(), out.sketches.end());
+
+    st.docs.insert(st.docs.end(), out.docs.begin(), out.docs.end());
+    for (auto& info : out.infos) st.infos.push_back(std::move(info));
+}
+
+// Бюджет делится между буферами постингов (по одному на ширину) и буфером
+// сортировки; порог — на один буфер.
+static std::size_t spill_run_records(const BuildOptions& opt) {
+    const std::size_t lists = opt.k13 ? 2 : 1;
+    return std::max<std::size_t>(std::size_t(1) << 16,
+                                 (std::size_t)(opt.mem_budget / ((lists + 1) * sizeof(PackedPosting))));
+}
+
+static bool spill_postings(const fs::path& spill_dir, unsigned threads, PostingList& pl, std::string& err) {
+    if (pl.recs.empty()) return true;
+    std::error_code ec;
+    fs::create_directories(spill_dir, ec);
+    if (ec) { err = "cannot create " + spill_dir.string() + ": " + ec.message(); return false; }
+    radix_sort_postings(pl.recs, pl.sort_tmp, threads);
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%s_%05zu.bin", pl.run_prefix, pl.run_paths.size());
+    const std::string path = (spill_dir / name).string();
+    if (!write_posting_run(path, pl.recs, err)) return false;
+    pl.run_paths.push_back(path);
+    pl.n_spilled += pl.recs.size();
+    pl.recs.clear();
+    return true;
+}
+
+// Reader -> N воркеров -> коммиттер. Воркеры берут батчи в любом порядке,
+// коммиттер забирает результаты строго по seq; max_in_flight ограничивает
+// число прочитанных, но ещё не закоммиченных батчей (память). Для
+// отображённого корпуса reader лишь раздаёт байтовые диапазоны: строки в
+// них находят и разбирают сами воркеры.
+class BatchPipeline {
+public:
+    explicit BatchPipeline(std::size_t max_in_flight) : max_in_flight_(max_in_flight) {}
+
+    void submit(Batch b) {
+        std::unique_lock<std::mutex> lk(m_);
+        cv_.wait(lk, [&] { return in_flight_ < max_in_flight_; });
+        ++in_flight_;
+        todo_.push_back(std::move(b));
+        cv_.notify_all();
+    }
+
+    void finish_input(std::uint64_t total) {
+        std::lock_guard<std::mutex> lk(m_);
+        input_done_ = true;
+        total_ = total;
+        cv_.notify_all();
+    }
+
+    bool next_batch(Batch& b) {
+        std::unique_lock<std::mutex> lk(m_);
+        cv_.wait(lk, [&] { return !todo_.empty() || input_done_; });
+        if (todo_.empty()) return false;
+        b = std::move(todo_.front());
+        todo_.pop_front();
+        return true;
+    }
+
+    void complete(std::uint64_t seq, BatchOut out) {
+        std::lock_guard<std::mutex> lk(m_);
+        done_.emplace(seq, std::move(out));
+        cv_.notify_all();
+    }
 
+    bool take(std::uint64_t seq, BatchOut& out) {
+        std::unique_lock<std::mutex> lk(m_);
+        cv_.wait(lk, [&] { return done_.count(seq) != 0 || (input_done_ && seq >= total_); });
+        auto it = done_.find(seq);
+        if (it == done_.end()) return false;
+        out = std::move(it->second);
+        done_.erase(it);
+        --in_flight_;
+        cv_.notify_all();
+        return true;
+    }
+
+private:
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<Batch> todo_;
+    std::map<std::uint64_t, BatchOut> done_;
+    std::size_t   max_in_flight_;
+    std::size_t   in_flight_  = 0;
+    bool          input_done_ = false;
+    std::uint64_t total_      = 0;
+};
+
+// Читает JSONL батчами; on_batch(Batch&&) вызывается в порядке файла.
+template <class F>
+static std::uint64_t read_batches(std::istream& in, F&& on_batch) {
+    std::uint64_t seq = 0;
+    Batch b;
+    std::size_t bytes = 0;
     std::string line;
     while (std::getline(in, line)) {
         if (line.empty()) continue;
-
-        DocInfo info;
-        std::string text;
-        if (!parse_line_json(line, info, text)) {
-            skipped_bad_json++;
-            continue;
+        bytes += line.size();
+        b.lines.push_back(std::move(line));
+        if (b.lines.size() >= BATCH_MAX_LINES || bytes >= BATCH_MAX_BYTES) {
+            b.seq = seq++;
+            on_batch(std::move(b));
+            b = Batch{};
+            bytes = 0;
         }
+    }
+    if (!b.lines.empty()) {
+        b.seq = seq++;
+        on_batch(std::move(b));
+    }
+    return seq;
+}
+
+// BulkWriter + index_checksum по тем же байтам (секции v3).
+struct ChecksumWriter {
+    BulkWriter&   out;
+    IndexChecksum ck;
+
+    void write(const char* p, std::streamsize n) {
+        ck.update(p, (std::size_t)n);
+        out.write(p, n);
+    }
+};
+
+// Отсортированный список пачками в emit: буфер в памяти или k-way merge
+// прогонов --mem-budget с остатком в памяти. Прогоны не удаляются.
+template <class Emit>
+static bool for_each_sorted(const BuildOptions& opt, const PostingList& pl, Emit&& emit, std::string& err) {
+    if (pl.run_paths.empty()) {
+        emit(pl.recs.data(), pl.recs.size());
+        return true;
+    }
+    const std::size_t merge_buf = std::clamp<std::size_t>(
+        (std::size_t)(opt.mem_budget / 2 / sizeof(PackedPosting) / (pl.run_paths.size() + 1)),
+        1024, std::size_t(1) << 16);
+    std::uint64_t merged = 0;
+    if (!merge_posting_runs(pl.run_paths, pl.recs, merge_buf, emit, merged, err)) return false;
+    if (merged != pl.size()) { err = "merged posting count mismatch"; return false; }
+    return true;
+}
+
+// Порог df: --df-max и/или P% от N_docs (--df-pct), берётся меньший, но не
+// ниже DF_MIN_THRESHOLD. Процент от документов, а не перцентиль по хэшам: в
+// корпусе почти у всех хэшей df = 1, и любой перцентиль дал бы порог 1.
+static std::uint32_t df_threshold(const BuildOptions& opt, std::uint32_t n_docs) {
+    std::uint32_t t = opt.df_max;
+    if (opt.df_pct > 0) {
+        const std::uint32_t p = (std::uint32_t)(opt.df_pct / 100.0 * (double)n_docs);
+        if (t == 0 || p < t) t = p;
+    }
+    return opt.df_prune() ? std::max(t, DF_MIN_THRESHOLD) : 0;
+}
 
-        std::string norm = normalize_for_shingles_simple(text);
+// Проход по отсортированному списку до записи: df каждого хэша, гистограмма
+// и сколько отсекается порогом — число постингов в заголовке известно до
+// записи секций.
+static bool count_df(const BuildOptions& opt, std::uint32_t threshold, PostingList& pl, std::string& err) {
+    DfStats& df = pl.df;
+    df = DfStats{};
+    df.threshold = threshold;
 
-        tokenize_spans(norm, spans);
-        if (spans.empty()) { skipped_bad_doc++; continue; }
+    std::uint64_t group_hash = 0, group_n = 0;
+    std::uint32_t group_df = 0, last_doc = 0;
+    auto end_group = [&] {
+        std::size_t b = 0;
+        while ((group_df >> (b + 1)) != 0) ++b;
+        if (df.hist_hashes.size() <= b) {
+            df.hist_hashes.resize(b + 1, 0);
+            df.hist_postings.resize(b + 1, 0);
+        }
+        ++df.hashes;
+        ++df.hist_hashes[b];
+        df.hist_postings[b] += group_n;
+        if (group_df > threshold) {
+            ++df.pruned_hashes;
+            df.pruned_postings += group_n;
+            df.stop_hashes.push_back(group_hash);
+        }
+    };
+    auto scan = [&](const PackedPosting* p, std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            if (group_n > 0 && p[i].hash != group_hash) {
+                end_group();
+                group_n = 0;
+            }
+            if (group_n == 0) { group_hash = p[i].hash; group_df = 1; }
+            else if (p[i].doc != last_doc) ++group_df;
+            last_doc = p[i].doc;
+            ++group_n;
+        }
+    };
+    if (!for_each_sorted(opt, pl, scan, err)) return false;
+    if (group_n > 0) end_group();
+    return true;
+}
 
-        if (MAX_TOKENS_PER_DOC > 0 && spans.size() > (std::size_t)MAX_TOKENS_PER_DOC)
-            spans.resize(MAX_TOKENS_PER_DOC);
+static json df_stats_json(const DfStats& df) {
+    return {
+        {"threshold", df.threshold},
+        {"hashes", df.hashes},
+        {"pruned_hashes", df.pruned_hashes},
+        {"pruned_postings", df.pruned_postings},
+        {"hist_hashes", df.hist_hashes},
+        {"hist_postings", df.hist_postings},
+    };
+}
 
-        if (spans.size() < (std::size_t)K) { skipped_bad_doc++; continue; }
+// Отсечение стоп-шинглов при записи: решение по каждому хэшу уже принято
+// в count_df, так что пачка в порядке (hash, doc) режется на отрезки без
+// буферизации групп — горячий список не держится в памяти целиком.
+template <class Keep, class Stop>
+class DfFilter {
+public:
+    DfFilter(const std::vector<std::uint64_t>& stop_hashes, Keep& keep, Stop& stop)
+        : stop_hashes_(stop_hashes), keep_(keep), stop_(stop) {}
 
-        const int n   = (int)spans.size();
-        const int cnt = n - K + 1;
-        if (cnt <= 0) { skipped_bad_doc++; continue; }
+    void operator()(const PackedPosting* p, std::size_t n) {
+        std::size_t run = 0;
+        bool run_stop = false;
+        for (std::size_t i = 0; i < n; ++i) {
+            while (next_ < stop_hashes_.size() && stop_hashes_[next_] < p[i].hash) ++next_;
+            const bool is_stop = next_ < stop_hashes_.size() && stop_hashes_[next_] == p[i].hash;
+            if (i > run && is_stop != run_stop) {
+                flush(p + run, i - run, run_stop);
+                run = i;
+            }
+            run_stop = is_stop;
+        }
+        if (n > run) flush(p + run, n - run, run_stop);
+    }
 
-        auto [hi, lo] = simhash128_spans(norm, spans);
+private:
+    const std::vector<std::uint64_t>& stop_hashes_;
+    Keep& keep_;
+    Stop& stop_;
+    std::size_t next_ = 0;
 
-        DocMeta dm{};
-        dm.tok_len    = (std::uint32_t)spans.size();
-        dm.simhash_hi = hi;
-        dm.simhash_lo = lo;
+    void flush(const PackedPosting* p, std::size_t n, bool is_stop) {
+        if (is_stop) stop_(p, n);
+        else         keep_(p, n);
+    }
+};
 
-        const std::uint32_t doc_idx = (std::uint32_t)docs.size();
-        docs.push_back(dm);
-        infos.push_back(std::move(info));
+// Секция postings (9 или 13) с текущей позиции bout: сырые записи или
+// pfor128, из памяти или слиянием прогонов --mem-budget. Заголовок сжатой
+// секции известен только после кодирования и пишется поверх заглушки;
+// checksum учитывает уже настоящий заголовок. С порогом df (count_df)
+// стоп-шинглы пропускаются, с --df-side — пишутся прогоном в stop_path.
+static bool write_postings(
+    const BuildOptions& opt,
+    PostingList& pl,
+    BulkWriter& bout,
+    std::uint64_t& bytes,
+    std::uint64_t& checksum,
+    std::string& err
+) {
+    const bool packed = opt.postings_codec != POSTINGS_CODEC_RAW;
+    const std::uint64_t start = bout.offset();
+    ChecksumWriter cw{bout, {}};
+    PackedPostingsEncoder<ChecksumWriter> enc(cw);
+    const PackedPostingsHeader placeholder{};
+    if (packed) cw.write((const char*)&placeholder, (std::streamsize)sizeof(placeholder));
 
-        const int step = (SHINGLE_STRIDE > 0 ? SHINGLE_STRIDE : 1);
-        std::uint32_t produced = 0;
-        const std::uint32_t max_sh =
-            (MAX_SHINGLES_PER_DOC > 0) ? MAX_SHINGLES_PER_DOC : (std::uint32_t)cnt;
+    auto emit = [&](const PackedPosting* p, std::size_t n) {
+        if (packed) enc.add(p, n);
+        else        cw.write((const char*)p, (std::streamsize)(n * sizeof(PackedPosting)));
+    };
 
-        for (int pos = 0; pos < cnt && produced < max_sh; pos += step) {
-            std::uint64_t h = hash_shingle_tokens_spans(norm, spans, pos, K);
-            postings9.emplace_back(h, doc_idx);
-            ++produced;
+    bool ok = true;
+    if (pl.df.threshold == 0) {
+        ok = for_each_sorted(opt, pl, emit, err);
+    } else {
+        std::ofstream side;
+        if (opt.df_side) {
+            side.open(pl.stop_path, std::ios::binary);
+            if (!side) { err = "cannot open " + pl.stop_path + " for write"; ok = false; }
         }
+        std::uint64_t n_stop = 0;
+        auto stop = [&](const PackedPosting* p, std::size_t n) {
+            if (opt.df_side) side.write((const char*)p, (std::streamsize)(n * sizeof(PackedPosting)));
+            n_stop += n;
+        };
+        DfFilter<decltype(emit), decltype(stop)> filter(pl.df.stop_hashes, emit, stop);
+        ok = ok && for_each_sorted(opt, pl, filter, err);
+        if (ok && opt.df_side && !side.flush()) { err = "write failed: " + pl.stop_path; ok = false; }
+        if (ok && n_stop != pl.df.pruned_postings) { err = "df pruned posting count mismatch"; ok = false; }
     }
+    for (const auto& path : pl.run_paths) {
+        std::error_code ec;
+        fs::remove(path, ec);
+    }
+    if (!ok) return false;
 
-    const std::uint32_t N_docs = (std::uint32_t)docs.size();
-    if (N_docs == 0) {
-        std::cerr << "no valid docs. skipped_bad_json=" << skipped_bad_json
-                  << " skipped_bad_doc=" << skipped_bad_doc << "\n";
-        return 1;
+    if (packed) {
+        const PackedPostingsHeader ph = enc.finish();
+        bout.patch(start, &ph, sizeof(ph));
+        checksum = index_checksum_replace_block(cw.ck.digest(), 0, &placeholder, &ph);
+        bytes = ph.section_bytes;
+    } else {
+        checksum = cw.ck.digest();
+        bytes = bout.offset() - start;
     }
+    return true;
+}
 
-    std::sort(postings9.begin(), postings9.end(),
-              [](const auto& a, const auto& b) {
-                  if (a.first < b.first) return true;
-                  if (a.first > b.first) return false;
-                  return a.second < b.second;
-              });
+// index_native.bin v1/v2: записи подряд без выравнивания.
+static bool write_index_records(
+    const BuildOptions& opt,
+    BuildState& st,
+    const IndexHeader& hdr,
+    BulkWriter& bout,
+    std::uint64_t& postings_bytes,
+    std::string& err
+) {
+    write_index_header(bout, hdr);
 
-    const std::uint64_t N_post9  = (std::uint64_t)postings9.size();
-    const std::uint64_t N_post13 = 0;
+    // DocMeta на диске без выравнивания (20 байт, с --dedup 24): поля копируются в буфер writer'а
+    for (const auto& dm : st.docs) {
+        bout.put(dm.tok_len);
+        bout.put(dm.simhash_hi);
+        bout.put(dm.simhash_lo);
+        if (opt.dedup) bout.put(dm.uniq_shingles);
+    }
+
+    // сжатые секции выравниваются, сырые postings13 идут вплотную за postings9
+    const bool packed = opt.postings_codec != POSTINGS_CODEC_RAW;
+    if (packed) bout.pad_to(INDEX_SECTION_ALIGN);
+    std::uint64_t checksum = 0;
+    if (!write_postings(opt, st.post9, bout, postings_bytes, checksum, err)) return false;
+    if (hdr.n_post13 > 0) {
+        if (packed) bout.pad_to(INDEX_SECTION_ALIGN);
+        std::uint64_t bytes13 = 0;
+        if (!write_postings(opt, st.post13, bout, bytes13, checksum, err)) return false;
+        postings_bytes += bytes13;
+    }
+
+    if (opt.sketch_k > 0) {
+        bout.pad_to(INDEX_SECTION_ALIGN);
+        bout.write((const char*)st.sketches.data(),
+                   (std::streamsize)(st.sketches.size() * sizeof(std::uint64_t)));
+    }
+    if (!bout) { err = bout.error(); return false; }
+    return true;
+}
+
+// Секция строк: u64 off[n + 1], затем байты поля всех документов подряд.
+static std::vector<char> string_section(const std::vector<DocInfo>& infos, std::string DocInfo::*field) {
+    const std::size_t n = infos.size();
+    std::vector<std::uint64_t> off(n + 1, 0);
+    for (std::size_t i = 0; i < n; ++i) off[i + 1] = off[i] + (infos[i].*field).size();
+    std::vector<char> blob((n + 1) * 8 + off[n]);
+    std::memcpy(blob.data(), off.data(), (n + 1) * 8);
+    char* pool = blob.data() + (n + 1) * 8;
+    for (std::size_t i = 0; i < n; ++i)
+        std::memcpy(pool + off[i], (infos[i].*field).data(), (infos[i].*field).size());
+    return blob;
+}
+
+// Каталог секций (index v3, meta, docids): место под записи резервируется
+// за заголовком, каталог дописывается в конце через patch.
+struct SectionWriter {
+    BulkWriter& out;
+    std::uint64_t dir_at;
+    std::vector<IndexSectionEntry> dir;
+
+    SectionWriter(BulkWriter& o, std::uint32_t n_sections) : out(o), dir_at(o.offset()) {
+        dir.reserve(n_sections);
+        for (std::uint32_t i = 0; i < n_sections; ++i) out.put(IndexSectionEntry{});
+    }
+
+    void add(IndexSection t, const void* p, std::size_t bytes) {
+        out.pad_to(INDEX_SECTION_ALIGN);
+        IndexSectionEntry e;
+        e.type     = (std::uint32_t)t;
+        e.offset   = out.offset();
+        e.length   = bytes;
+        e.checksum = index_checksum(p, bytes);
+        out.write((const char*)p, (std::streamsize)bytes);
+        dir.push_back(e);
+    }
+
+    void finish() { out.patch(dir_at, dir.data(), dir.size() * sizeof(IndexSectionEntry)); }
+};
+
+// Заголовок index_native_meta.bin / index_native_docids.bin: 64 байта.
+static void write_side_header(BulkWriter& out, const char (&magic)[4], std::uint32_t version,
+                              std::uint32_t n_docs, std::uint32_t n_sections) {
+    out.write(magic, 4);
+    out.put(version);
+    out.put(n_docs);
+    out.put(n_sections);
+    out.pad_to(DOC_META_HEADER_BYTES);
+}
+
+// Колонки DocMeta: tok_len, simhash_hi/lo, uniq_shingles (dedup).
+static void write_docmeta_columns(const BuildOptions& opt, const BuildState& st, SectionWriter& sw) {
+    const std::size_t n = st.docs.size();
+    std::vector<std::uint32_t> c32(n);
+    std::vector<std::uint64_t> c64(n);
+    for (std::size_t i = 0; i < n; ++i) c32[i] = st.docs[i].tok_len;
+    sw.add(IndexSection::DocTokLen, c32.data(), n * 4);
+    for (std::size_t i = 0; i < n; ++i) c64[i] = st.docs[i].simhash_hi;
+    sw.add(IndexSection::DocSimhashHi, c64.data(), n * 8);
+    for (std::size_t i = 0; i < n; ++i) c64[i] = st.docs[i].simhash_lo;
+    sw.add(IndexSection::DocSimhashLo, c64.data(), n * 8);
+    if (opt.dedup) {
+        for (std::size_t i = 0; i < n; ++i) c32[i] = st.docs[i].uniq_shingles;
+        sw.add(IndexSection::DocUniqShingles, c32.data(), n * 4);
+    }
+}
+
+// index_native.bin v3: заголовок, каталог (дописывается в конце), секции
+// с выравниванием на INDEX_SECTION_ALIGN. DocMeta раскладывается по колонкам.
+static bool write_index_v3(
+    const BuildOptions& opt,
+    BuildState& st,
+    IndexHeader hdr,
+    BulkWriter& bout,
+    std::uint64_t& postings_bytes,
+    std::string& err
+) {
+    const bool stop13 = opt.df_side && st.post13.size() > 0;
+    hdr.n_sections = 5 + (opt.dedup ? 1 : 0) + (opt.sketch_k > 0 ? 1 : 0) + (hdr.n_post13 > 0 ? 1 : 0) +
+                     (opt.df_side ? 1 : 0) + (stop13 ? 1 : 0);
+    write_index_header(bout, hdr);
+
+    SectionWriter sw(bout, hdr.n_sections);
+    write_docmeta_columns(opt, st, sw);
+
+    auto postings = [&](IndexSection t, PostingList& pl) {
+        bout.pad_to(INDEX_SECTION_ALIGN);
+        IndexSectionEntry e;
+        e.type   = (std::uint32_t)t;
+        e.offset = bout.offset();
+        if (!write_postings(opt, pl, bout, e.length, e.checksum, err)) return false;
+        sw.dir.push_back(e);
+        postings_bytes += e.length;
+        return true;
+    };
+    postings_bytes = 0;
+    if (!postings(IndexSection::Postings9, st.post9)) return false;
+    if (hdr.n_post13 > 0 && !postings(IndexSection::Postings13, st.post13)) return false;
+
+    // --df-side: отсечённые постинги тем же кодеком из прогона count_df
+    auto stop_postings = [&](IndexSection t, const PostingList& pl) {
+        PostingList stop("stop");
+        if (pl.df.pruned_postings > 0) {
+            stop.run_paths.push_back(pl.stop_path);
+            stop.n_spilled = pl.df.pruned_postings;
+        }
+        return postings(t, stop);
+    };
+    if (opt.df_side && !stop_postings(IndexSection::StopPostings9, st.post9)) return false;
+    if (stop13 && !stop_postings(IndexSection::StopPostings13, st.post13)) return false;
+
+    if (opt.sketch_k > 0)
+        sw.add(IndexSection::Sketches, st.sketches.data(), st.sketches.size() * sizeof(std::uint64_t));
 
-    // ---- write index_native.bin
     {
-        const fs::path bin_path = out_dir / "index_native.bin";
-        std::ofstream bout(bin_path, std::ios::binary);
-        if (!bout) {
-            std::cerr << "cannot open " << bin_path << " for write\n";
-            return 1;
+        const std::vector<char> blob = string_section(st.infos, &DocInfo::doc_id);
+        sw.add(IndexSection::DocIds, blob.data(), blob.size());
+    }
+
+    sw.finish();
+    if (!bout) { err = bout.error(); return false; }
+    return true;
+}
+
+// index_native_meta.bin: колонки DocMeta и строки title/author по номеру doc.
+static bool write_doc_meta(const BuildOptions& opt, const BuildState& st, const fs::path& p, std::string& err) {
+    BulkWriter out;
+    if (!out.open(p.string(), err)) return false;
+
+    const std::uint32_t n_sections = 5 + (opt.dedup ? 1 : 0);
+    write_side_header(out, DOC_META_MAGIC, DOC_META_VERSION, (std::uint32_t)st.docs.size(), n_sections);
+    SectionWriter sw(out, n_sections);
+    write_docmeta_columns(opt, st, sw);
+    {
+        const std::vector<char> title = string_section(st.infos, &DocInfo::title);
+        sw.add(IndexSection::DocTitle, title.data(), title.size());
+        const std::vector<char> author = string_section(st.infos, &DocInfo::author);
+        sw.add(IndexSection::DocAuthor, author.data(), author.size());
+    }
+    sw.finish();
+    return out.close(err);
+}
+
+// index_native_docids.bin: строки id и хэш-таблица id -> doc (index_format.h).
+static bool write_doc_ids(const BuildState& st, const fs::path& p, std::string& err) {
+    BulkWriter out;
+    if (!out.open(p.string(), err)) return false;
+
+    const std::uint32_t n = (std::uint32_t)st.infos.size();
+    write_side_header(out, DOC_IDS_MAGIC, DOC_IDS_VERSION, n, 2);
+    SectionWriter sw(out, 2);
+    {
+        const std::vector<char> blob = string_section(st.infos, &DocInfo::doc_id);
+        sw.add(IndexSection::DocIds, blob.data(), blob.size());
+    }
+    {
+        // повторный id (в корпусе он допустим) не вставляется: обратный
+        // поиск находит первый документ с этим id
+        const std::uint32_t bits = doc_id_table_bits(n);
+        const std::uint64_t mask = (1ull << bits) - 1;
+        std::vector<std::uint32_t> slots((std::size_t)mask + 1, 0);
+        for (std::uint32_t d = 0; d < n; ++d) {
+            const std::string& id = st.infos[d].doc_id;
+            std::uint64_t i = doc_id_slot(doc_id_hash(id.data(), id.size()), bits);
+            while (slots[i] != 0 && st.infos[slots[i] - 1].doc_id != id) i = (i + 1) & mask;
+            if (slots[i] == 0) slots[i] = d + 1;
         }
+        sw.add(IndexSection::DocIdHash, slots.data(), slots.size() * 4);
+    }
+    sw.finish();
+    return out.close(err);
+}
 
-        const char magic[4] = {'P','L','A','G'};
-        std::uint32_t version = 1;
+static IndexParams index_params_of(const BuildOptions& opt) {
+    IndexParams p;
+    p.norm_mode      = (std::uint32_t)opt.tp.norm;
+    p.hash_family    = (std::uint32_t)opt.tp.hash;
+    p.token_ids      = opt.intern ? 1u : 0u;
+    p.winnow_w       = (std::uint32_t)opt.winnow_w;
+    p.sketch_k       = (std::uint32_t)opt.sketch_k;
+    p.postings_codec = opt.postings_codec;
+    p.dedup          = opt.dedup ? 1u : 0u;
+    p.layout         = opt.layout;
+    return p;
+}
 
-        bout.write(magic, 4);
-        bout.write((const char*)&version, sizeof(version));
-        bout.write((const char*)&N_docs,  sizeof(N_docs));
-        bout.write((const char*)&N_post9, sizeof(N_post9));
-        bout.write((const char*)&N_post13,sizeof(N_post13));
+static SegmentBuildConfig segment_config_of(const BuildOptions& opt) {
+    SegmentBuildConfig c;
+    c.k13     = opt.k13;
+    c.df_max  = opt.df_max;
+    c.df_pct  = opt.df_pct;
+    c.df_side = opt.df_side;
+    return c;
+}
+
+static void apply_index_params(const IndexParams& p, BuildOptions& opt) {
+    opt.tp.norm         = (NormMode)p.norm_mode;
+    opt.tp.hash         = (HashFamily)p.hash_family;
+    opt.intern          = p.token_ids != 0;
+    opt.winnow_w        = (int)p.winnow_w;
+    opt.sketch_k        = (int)p.sketch_k;
+    opt.postings_codec  = p.postings_codec;
+    opt.dedup           = p.dedup != 0;
+    opt.layout          = p.layout;
+}
+
+struct IndexWriteStats {
+    std::uint64_t n_post9        = 0;
+    std::uint64_t n_post13       = 0;
+    std::uint64_t df_pruned      = 0;   // --df-max / --df-pct: отсечённые постинги
+    std::uint64_t postings_bytes = 0;
+    std::uint64_t write_bytes    = 0;
+    double        write_s        = 0.0;   // системные вызовы записи index_native.bin
+    double        write_mbps     = 0.0;
+    double        index_s        = 0.0;   // index_native.bin целиком: слияние, кодирование, запись
+};
+
+// Сортировка постингов и запись каталога индекса: index_native.bin,
+// словарь (--intern), docids и meta. Общая часть сборки и --merge.
+static bool write_index_dir(
+    const BuildOptions& opt,
+    BuildState& st,
+    const fs::path& out_dir,
+    unsigned threads,
+    IndexWriteStats& ws,
+    std::string& err
+) {
+    const TextParams& tp = opt.tp;
+    auto& docs      = st.docs;
+    auto& infos     = st.infos;
+    const std::uint32_t N_docs = (std::uint32_t)docs.size();
+    const fs::path spill_dir = out_dir / "spill_runs";
+
+    // постинги набраны в порядке doc: устойчивый radix по hash даёт (hash, doc).
+    // С --k13 списки независимы и сортируются одновременно, потоки — пополам.
+    if (!st.post13.recs.empty() && threads > 1) {
+        const unsigned t13 = threads / 2;
+        std::thread sort13([&] { radix_sort_postings(st.post13.recs, st.post13.sort_tmp, t13); });
+        radix_sort_postings(st.post9.recs, st.post9.sort_tmp, threads - t13);
+        sort13.join();
+    } else {
+        radix_sort_postings(st.post9.recs, st.post9.sort_tmp, threads);
+        radix_sort_postings(st.post13.recs, st.post13.sort_tmp, threads);
+    }
+    st.post9.sort_tmp  = std::vector<PackedPosting>();
+    st.post13.sort_tmp = std::vector<PackedPosting>();
 
-        for (const auto& dm : docs) {
-            bout.write((const char*)&dm.tok_len,    sizeof(dm.tok_len));
-            bout.write((const char*)&dm.simhash_hi, sizeof(dm.simhash_hi));
-            bout.write((const char*)&dm.simhash_lo, sizeof(dm.simhash_lo));
+    // --df-max / --df-pct: df хэшей и порог; в заголовок идут оставшиеся постинги
+    if (opt.df_prune()) {
+        if (opt.df_side) {
+            std::error_code ec;
+            fs::create_directories(spill_dir, ec);
+            if (ec) { err = "cannot create " + spill_dir.string() + ": " + ec.message(); return false; }
+            st.post9.stop_path  = (spill_dir / "stop.bin").string();
+            st.post13.stop_path = (spill_dir / "stop13.bin").string();
         }
+        const std::uint32_t threshold = df_threshold(opt, N_docs);
+        if (!count_df(opt, threshold, st.post9, err) || !count_df(opt, threshold, st.post13, err)) return false;
+    }
+    const std::uint64_t N_post9  = st.post9.size() - st.post9.df.pruned_postings;
+    const std::uint64_t N_post13 = st.post13.size() - st.post13.df.pruned_postings;
+
+    // ---- write index_native.bin
+    BulkWriter bout;
+    std::uint64_t postings_bytes = 0;
+    {
+        const fs::path bin_path = out_dir / "index_native.bin";
+        if (!bout.open(bin_path.string(), err)) return false;
 
-        for (const auto& p : postings9) {
-            const std::uint64_t h = p.first;
-            const std::uint32_t d = p.second;
-            bout.write((const char*)&h, sizeof(h));
-            bout.write((const char*)&d, sizeof(d));
+        IndexHeader hdr;
+        hdr.n_docs   = N_docs;
+        hdr.n_post9  = N_post9;
+        hdr.n_post13 = N_post13;
+        hdr.params   = index_params_of(opt);
+        hdr.version  = hdr.params.is_default() ? INDEX_VERSION_V1 : INDEX_VERSION_V2;
+        if (opt.layout == INDEX_LAYOUT_MMAP) hdr.version = INDEX_VERSION_V3;
+
+        const bool ok = opt.layout == INDEX_LAYOUT_MMAP
+            ? write_index_v3(opt, st, hdr, bout, postings_bytes, err)
+            : write_index_records(opt, st, hdr, bout, postings_bytes, err);
+        if (!st.post9.run_paths.empty() || !st.post13.run_paths.empty() || opt.df_side) {
+            std::error_code ec;
+            fs::remove_all(spill_dir, ec);
         }
+        if (!ok || !bout.close(err)) return false;
+    }
+
+    // ---- write index_native_dict.bin
+    if (opt.intern) {
+        const fs::path p = out_dir / "index_native_dict.bin";
+        if (!st.dict.write(p.string(), tp, err)) return false;
     }
 
-    // ---- write index_native_docids.json
+    // ---- write index_native_docids.bin
     {
+        const fs::path p = out_dir / "index_native_docids.bin";
+        if (!write_doc_ids(st, p, err)) return false;
+    }
+
+    // ---- write index_native_docids.json (--docids-json; старые читатели)
+    if (opt.docids_json) {
         std::vector<std::string> doc_ids;
         doc_ids.reserve(infos.size());
         for (auto& x : infos) doc_ids.push_back(x.doc_id);
 
         const fs::path p = out_dir / "index_native_docids.json";
         std::ofstream f(p);
-        if (!f) {
-            std::cerr << "cannot open " << p << " for write\n";
-            return 1;
-        }
+        if (!f) { err = "cannot open " + p.string() + " for write"; return false; }
         f << json(doc_ids).dump();
     }
 
-    // ---- write index_native_meta.json
+    // ---- write index_native_meta.bin
     {
-        json docs_meta = json::object();
-        for (std::size_t i = 0; i < infos.size(); ++i) {
-            const auto& info = infos[i];
-            const auto& dm   = docs[i];
+        const fs::path p = out_dir / "index_native_meta.bin";
+        if (!write_doc_meta(opt, st, p, err)) return false;
+    }
 
-            json m;
-            m["tok_len"]    = dm.tok_len;
-            m["simhash_hi"] = dm.simhash_hi;
-            m["simhash_lo"] = dm.simhash_lo;
-            if (!info.title.empty())  m["title"]  = info.title;
-            if (!info.author.empty()) m["author"] = info.author;
+    // ---- write index_native_meta.json: config и stats; docs_meta — только
+    // с --meta-json (для поиска метаданные лежат в index_native_meta.bin)
+    {
+        json meta;
+        if (opt.meta_json) {
+            json docs_meta = json::object();
+            for (std::size_t i = 0; i < infos.size(); ++i) {
+                const auto& info = infos[i];
+                const auto& dm   = docs[i];
 
-            docs_meta[info.doc_id] = std::move(m);
-        }
+                json m;
+                m["tok_len"]    = dm.tok_len;
+                m["simhash_hi"] = dm.simhash_hi;
+                m["simhash_lo"] = dm.simhash_lo;
+                if (opt.dedup) m["uniq_shingles"] = dm.uniq_shingles;
+                if (!info.title.empty())  m["title"]  = info.title;
+                if (!info.author.empty()) m["author"] = info.author;
 
-        json meta;
-        meta["docs_meta"] = std::move(docs_meta);
+                docs_meta[info.doc_id] = std::move(m);
+            }
+            meta["docs_meta"] = std::move(docs_meta);
+        }
         meta["config"] = {
             {"thresholds", {{"plag_thr", 0.7}, {"partial_thr", 0.3}}}
         };
-        meta["stats"] = {{"docs", N_docs}, {"k9", N_post9}, {"k13", 0}};
+        if (tp.norm != NormMode::Ascii)        meta["config"]["norm"] = norm_mode_name(tp.norm);
+        if (tp.hash != HashFamily::Fnv1a64)    meta["config"]["hash"] = hash_family_name(tp.hash);
+        meta["stats"] = {{"docs", N_docs}, {"k9", N_post9}, {"k13", N_post13}};
+        if (opt.winnow_w > 0) meta["config"]["winnow_w"] = opt.winnow_w;
+        if (opt.sketch_k > 0) meta["config"]["sketch_k"] = opt.sketch_k;
+        if (opt.dedup) meta["config"]["dedup"] = true;
+        if (opt.k13) meta["config"]["k13"] = true;
+        if (opt.df_max > 0) meta["config"]["df_max"] = opt.df_max;
+        if (opt.df_pct > 0) meta["config"]["df_pct"] = opt.df_pct;
+        if (opt.df_side) meta["config"]["df_side"] = true;
+        if (opt.df_prune()) {
+            meta["stats"]["df9"] = df_stats_json(st.post9.df);
+            if (opt.k13) meta["stats"]["df13"] = df_stats_json(st.post13.df);
+        }
+        if (opt.layout == INDEX_LAYOUT_MMAP) meta["config"]["format"] = "v3";
+        if (opt.postings_codec != POSTINGS_CODEC_RAW) meta["config"]["postings"] = postings_codec_name(opt.postings_codec);
+        if (opt.intern) {
+            meta["config"]["token_ids"] = true;
+            meta["stats"]["vocab"] = st.dict.size();
+        }
 
         const fs::path p = out_dir / "index_native_meta.json";
         std::ofstream f(p);
-        if (!f) {
-            std::cerr << "cannot open " << p << " for write\n";
+        if (!f) { err = "cannot open " + p.string() + " for write"; return false; }
+        f << meta.dump();
+    }
+
+    ws.n_post9        = N_post9;
+    ws.n_post13       = N_post13;
+    ws.df_pruned      = st.post9.df.pruned_postings + st.post13.df.pruned_postings;
+    ws.postings_bytes = postings_bytes;
+    ws.write_bytes    = bout.bytes();
+    ws.write_s        = bout.seconds();
+    ws.write_mbps     = bout.mb_per_s();
+    ws.index_s        = bout.wall_seconds();
+    return true;
+}
+
+// Tombstones для --segment: по doc_id на строку.
+static bool read_tombstones_file(const fs::path& p, std::vector<std::string>& out, std::string& err) {
+    std::ifstream in(p);
+    if (!in) { err = "cannot open " + p.string(); return false; }
+    std::string line;
+    while (std::getline(in, line)) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+        if (!line.empty()) out.push_back(line);
+    }
+    return true;
+}
+
+// Резервирует имя нового сегмента в наборе; параметры сборки должны
+// совпадать с уже лежащими сегментами.
+static bool reserve_segment(const fs::path& set_dir, const IndexParams& params, const SegmentBuildConfig& cfg,
+                            std::string& name, std::string& err) {
+    std::error_code ec;
+    fs::create_directories(set_dir, ec);
+    if (ec) { err = "cannot create " + set_dir.string() + ": " + ec.message(); return false; }
+
+    SegmentSetLock lk;
+    SegmentManifest m;
+    if (!lk.lock(set_dir, err) || !load_segment_manifest(set_dir, m, err)) return false;
+    if (!m.segments.empty()) {
+        IndexHeader h;
+        if (!read_segment_header(set_dir / m.segments.back().name, h, err)) return false;
+        if (!check_segment_compat(h.params, params, err)) return false;
+        SegmentBuildConfig set_cfg;
+        if (!read_segment_config(set_dir / m.segments.back().name, set_cfg, err) ||
+            !check_segment_config(set_cfg, cfg, err)) return false;
+    }
+    name = segment_name(m.next_id++);
+    return save_segment_manifest(set_dir, m, err);
+}
+
+static bool publish_segment(const fs::path& set_dir, const SegmentEntry& e, std::string& err) {
+    SegmentSetLock lk;
+    SegmentManifest m;
+    if (!lk.lock(set_dir, err) || !load_segment_manifest(set_dir, m, err)) return false;
+    m.segments.push_back(e);
+    return save_segment_manifest(set_dir, m, err);
+}
+
+// index_builder --merge <set_dir>: слияние серии сегментов (plan_segment_merge)
+// в один. Живые документы переносятся без повторного шинглирования: DocMeta,
+// скетчи и постинги копируются с перенумерацией doc, постинги заново
+// сортируются (с --mem-budget — прогонами). Набор обновляется под
+// блокировкой; если за время слияния серия изменилась, результат выбрасывается.
+static int run_merge(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: index_builder --merge <set_dir> [--all] [--fanout N] [--threads N] [--mem-budget MB] [--meta-json] [--docids-json] [--df-max N] [--df-pct P] [--df-side]\n";
+        return 1;
+    }
+    const fs::path set_dir = argv[2];
+
+    BuildOptions opt;
+    bool all = false;
+    bool df_args = false;   // --df-*: сверяются с настройками сегментов
+    std::size_t fanout = SEGMENT_MERGE_FANOUT;
+    int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 3; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (a == "--all") {
+            all = true;
+        } else if (a == "--meta-json") {
+            opt.meta_json = true;
+        } else if (a == "--docids-json") {
+            opt.docids_json = true;
+        } else if (a == "--df-max" && i + 1 < argc) {
+            const long long n = std::atoll(argv[++i]);
+            if (n < DF_MIN_THRESHOLD || n > 0xffffffffll) {
+                std::cerr << "bad --df-max: " << argv[i] << " (min " << DF_MIN_THRESHOLD << ")\n";
+                return 1;
+            }
+            opt.df_max = (std::uint32_t)n;
+            df_args = true;
+        } else if (a == "--df-pct" && i + 1 < argc) {
+            opt.df_pct = std::atof(argv[++i]);
+            if (!(opt.df_pct > 0 && opt.df_pct < 100)) {
+                std::cerr << "bad --df-pct: " << argv[i] << "\n";
+                return 1;
+            }
+            df_args = true;
+        } else if (a == "--df-side") {
+            opt.df_side = true;
+            df_args = true;
+        } else if (a == "--fanout" && i + 1 < argc) {
+            const int f = std::atoi(argv[++i]);
+            if (f < 2) {
+                std::cerr << "bad --fanout: " << argv[i] << "\n";
+                return 1;
+            }
+            fanout = (std::size_t)f;
+        } else if (a == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+            if (threads < 1) {
+                std::cerr << "bad --threads: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (a == "--mem-budget" && i + 1 < argc) {
+            const long long mb = std::atoll(argv[++i]);
+            if (mb < 1) {
+                std::cerr << "bad --mem-budget: " << argv[i] << "\n";
+                return 1;
+            }
+            opt.mem_budget = (std::uint64_t)mb << 20;
+        } else {
+            std::cerr << "unknown argument: " << a << "\n";
+            return 1;
+        }
+    }
+
+    auto fail = [](const std::string& err) {
+        std::cerr << err << "\n";
+        return 1;
+    };
+
+    std::string err;
+    SegmentManifest m;
+    std::size_t first = 0, count = 0;
+    std::string out_name;
+    {
+        SegmentSetLock lk;
+        if (!lk.lock(set_dir, err) || !load_segment_manifest(set_dir, m, err)) return fail(err);
+        if (!plan_segment_merge(m, fanout, all, first, count)) {
+            std::cout << "[index_builder] merge: nothing to do segments=" << m.segments.size() << "\n";
+            return 0;
+        }
+        out_name = segment_name(m.next_id++);
+        if (!save_segment_manifest(set_dir, m, err)) return fail(err);
+    }
+
+    std::vector<SegmentDocs> sdocs;
+    if (!load_segment_docs(set_dir, m, sdocs, err)) return fail(err);
+
+    // настройки вне IndexParams (k13, df) общие для серии и переходят в
+    // результат; флаги --df-* слияния лишь сверяются с ними
+    SegmentBuildConfig cfg;
+    for (std::size_t s = first; s < first + count; ++s) {
+        const fs::path seg_dir = set_dir / m.segments[s].name;
+        SegmentBuildConfig c;
+        if (!read_segment_config(seg_dir, c, err)) return fail(err);
+        if (s == first) cfg = c;
+        else if (!check_segment_config(cfg, c, err)) return fail(seg_dir.string() + ": " + err);
+    }
+    if (df_args) {
+        SegmentBuildConfig want = cfg;
+        want.df_max  = opt.df_max;
+        want.df_pct  = opt.df_pct;
+        want.df_side = opt.df_side;
+        if (want != cfg) return fail("--df-* differ from segment set settings");
+    }
+    opt.k13     = cfg.k13;
+    opt.df_max  = cfg.df_max;
+    opt.df_pct  = cfg.df_pct;
+    opt.df_side = cfg.df_side;
+
+    const fs::path out_dir   = set_dir / out_name;
+    const fs::path spill_dir = out_dir / "spill_runs";
+    const std::size_t spill_records = spill_run_records(opt);
+    fs::create_directories(out_dir);
+
+    BuildState st;
+    std::vector<std::string> tombstones;
+    std::uint64_t n_in_docs = 0;
+    for (std::size_t s = first; s < first + count; ++s) {
+        const fs::path seg_dir = set_dir / m.segments[s].name;
+        SegmentReader r;
+        if (!r.open(seg_dir, err)) return fail(err);
+        const IndexHeader& h = r.header();
+        if (s == first) {
+            apply_index_params(h.params, opt);
+            if (opt.intern) return fail("cannot merge segments with token id shingles (--intern)");
+            if (opt.df_side && (!opt.df_prune() || opt.layout != INDEX_LAYOUT_MMAP))
+                return fail("--df-side requires --df-max or --df-pct and v3 segments");
+        } else if (!check_segment_compat(index_params_of(opt), h.params, err)) {
+            return fail(seg_dir.string() + ": " + err);
+        }
+
+        const SegmentDocs& sd = sdocs[s];
+        if (sd.doc_ids.size() != h.n_docs) return fail("doc id count mismatch in " + seg_dir.string());
+        // title/author: index_native_meta.bin, у старых сегментов — docs_meta
+        MappedDocMeta dmeta;
+        json docs_meta;
+        if (fs::exists(seg_dir / "index_native_meta.bin")) {
+            if (!dmeta.open((seg_dir / "index_native_meta.bin").string(), err))
+                return fail(seg_dir.string() + "/index_native_meta.bin: " + err);
+            if (dmeta.n_docs() != h.n_docs) return fail("doc meta count mismatch in " + seg_dir.string());
+        } else {
+            try {
+                std::ifstream f(seg_dir / "index_native_meta.json");
+                docs_meta = json::parse(f).at("docs_meta");
+            } catch (const std::exception& e) {
+                return fail(seg_dir.string() + "/index_native_meta.json: " + e.what());
+            }
+        }
+
+        constexpr std::uint32_t DEAD = ~0u;
+        std::vector<std::uint32_t> remap(h.n_docs, DEAD);
+        for (std::uint32_t i = 0; i < h.n_docs; ++i) {
+            if (!sd.live[i]) continue;
+            remap[i] = (std::uint32_t)st.docs.size();
+            st.docs.push_back({r.tok_len(i), r.simhash_hi(i), r.simhash_lo(i), r.uniq_shingles(i)});
+
+            DocInfo info;
+            info.doc_id = sd.doc_ids[i];
+            if (dmeta.n_docs() > 0) {
+                info.title.assign(dmeta.title(i));
+                info.author.assign(dmeta.author(i));
+            } else {
+                const auto it = docs_meta.find(info.doc_id);
+                if (it != docs_meta.end()) {
+                    info.title  = it->value("title", "");
+                    info.author = it->value("author", "");
+                }
+            }
+            st.infos.push_back(std::move(info));
+            if (opt.sketch_k > 0)
+                st.sketches.insert(st.sketches.end(), r.sketches() + (std::size_t)i * opt.sketch_k,
+                                   r.sketches() + (std::size_t)(i + 1) * opt.sketch_k);
+        }
+
+        std::string spill_err;
+        auto copy_to = [&](PostingList& pl) {
+            return [&](std::uint64_t hash, std::uint32_t doc) {
+                if (doc >= h.n_docs || remap[doc] == DEAD || !spill_err.empty()) return;
+                if (opt.mem_budget > 0 && pl.recs.size() >= spill_records &&
+                    !spill_postings(spill_dir, (unsigned)threads, pl, spill_err))
+                    return;
+                pl.recs.push_back({hash, remap[doc]});
+            };
+        };
+        r.for_each_posting(copy_to(st.post9));
+        r.for_each_posting13(copy_to(st.post13));
+        // стоп-шинглы --df-side возвращаются в поток и отсекаются заново
+        if (!r.for_each_stop_posting(IndexSection::StopPostings9, copy_to(st.post9), err) ||
+            !r.for_each_stop_posting(IndexSection::StopPostings13, copy_to(st.post13), err))
+            return fail(seg_dir.string() + ": " + err);
+        if (!spill_err.empty()) return fail(spill_err);
+
+        // удаления нужны, пока старше серии есть сегменты
+        if (first > 0) tombstones.insert(tombstones.end(), sd.tombstones.begin(), sd.tombstones.end());
+        n_in_docs += h.n_docs;
+    }
+    std::sort(tombstones.begin(), tombstones.end());
+    tombstones.erase(std::unique(tombstones.begin(), tombstones.end()), tombstones.end());
+
+    IndexWriteStats ws;
+    if (!write_index_dir(opt, st, out_dir, (unsigned)threads, ws, err)) return fail(err);
+    if (!tombstones.empty() && !write_segment_tombstones(out_dir, tombstones, err)) return fail(err);
+
+    const std::uint32_t level = segment_level((std::uint32_t)st.docs.size());
+    std::vector<std::string> merged;
+    {
+        SegmentSetLock lk;
+        SegmentManifest cur;
+        if (!lk.lock(set_dir, err) || !load_segment_manifest(set_dir, cur, err)) return fail(err);
+        std::size_t at = cur.segments.size();
+        for (std::size_t j = 0; j + count <= cur.segments.size() && at == cur.segments.size(); ++j) {
+            bool same = true;
+            for (std::size_t k = 0; k < count && same; ++k)
+                same = cur.segments[j + k].name == m.segments[first + k].name;
+            if (same) at = j;
+        }
+        if (at == cur.segments.size()) {
+            std::error_code ec;
+            fs::remove_all(out_dir, ec);
+            return fail("segment set changed during merge: " + set_dir.string());
+        }
+        for (std::size_t k = 0; k < count; ++k) merged.push_back(cur.segments[at + k].name);
+        cur.segments.erase(cur.segments.begin() + (std::ptrdiff_t)at, cur.segments.begin() + (std::ptrdiff_t)(at + count));
+        cur.segments.insert(cur.segments.begin() + (std::ptrdiff_t)at, SegmentEntry{out_name, level, (std::uint32_t)st.docs.size()});
+        if (!save_segment_manifest(set_dir, cur, err)) return fail(err);
+    }
+    for (const auto& name : merged) {
+        std::error_code ec;
+        fs::remove_all(set_dir / name, ec);
+    }
+
+    std::cout << "[index_builder] merge ok segments=" << count
+              << " docs_in=" << n_in_docs
+              << " docs=" << st.docs.size()
+              << " post9=" << ws.n_post9
+              << " post13=" << ws.n_post13;
+    if (opt.df_prune()) std::cout << " df_pruned=" << ws.df_pruned;
+    std::cout
+              << " tombstones=" << tombstones.size()
+              << " level=" << level
+              << " write_mb=" << (double)ws.write_bytes / (1 << 20)
+              << " out_dir=" << out_dir << "\n";
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && std::string(argv[1]) == "--merge") return run_merge(argc, argv);
+    if (argc < 3) {
+        std::cerr << "Usage: index_builder <corpus_jsonl> <out_dir> [--norm ascii|utf8] [--hash fnv1a64|wy64] [--intern] [--winnow W] [--sketch K] [--threads N] [--mem-budget MB] [--postings raw|pfor128] [--dedup] [--k13] [--format v1|v3] [--meta-json] [--docids-json] [--df-max N] [--df-pct P] [--df-side] [--segment [--tombstones FILE]]\n"
+                  << "       index_builder --merge <set_dir> [--all] [--fanout N] [--threads N] [--mem-budget MB] [--meta-json] [--docids-json] [--df-max N] [--df-pct P] [--df-side]\n";
+        return 1;
+    }
+
+    const fs::path corpus_path = argv[1];
+    fs::path out_dir           = argv[2];
+    bool segment = false;              // --segment: out_dir — набор сегментов, пишется новый seg_NNNNNN
+    fs::path tombstones_path;
+
+    BuildOptions opt;
+    TextParams& tp = opt.tp;
+    bool& intern   = opt.intern;
+    int& winnow_w  = opt.winnow_w;
+    int& sketch_k  = opt.sketch_k;
+    int threads    = (int)std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 3; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (a == "--norm" && i + 1 < argc) {
+            if (!parse_norm_mode(argv[++i], tp.norm)) {
+                std::cerr << "bad --norm: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (a == "--hash" && i + 1 < argc) {
+            if (!parse_hash_family(argv[++i], tp.hash)) {
+                std::cerr << "bad --hash: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (a == "--intern") {
+            intern = true;
+        } else if (a == "--winnow" && i + 1 < argc) {
+            winnow_w = std::atoi(argv[++i]);
+            if (winnow_w < 1) {
+                std::cerr << "bad --winnow: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (a == "--sketch" && i + 1 < argc) {
+            sketch_k = std::atoi(argv[++i]);
+            if (sketch_k < 1) {
+                std::cerr << "bad --sketch: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (a == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+            if (threads < 1) {
+                std::cerr << "bad --threads: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (a == "--mem-budget" && i + 1 < argc) {
+            const long long mb = std::atoll(argv[++i]);
+            if (mb < 1) {
+                std::cerr << "bad --mem-budget: " << argv[i] << "\n";
+                return 1;
+            }
+            opt.mem_budget = (std::uint64_t)mb << 20;
+        } else if (a == "--format" && i + 1 < argc) {
+            const std::string f = argv[++i];
+            if (f == "v1")      opt.layout = INDEX_LAYOUT_RECORDS;
+            else if (f == "v3") opt.layout = INDEX_LAYOUT_MMAP;
+            else {
+                std::cerr << "bad --format: " << f << "\n";
+                return 1;
+            }
+        } else if (a == "--dedup") {
+            opt.dedup = true;
+        } else if (a == "--k13") {
+            opt.k13 = true;
+        } else if (a == "--meta-json") {
+            opt.meta_json = true;
+        } else if (a == "--docids-json") {
+            opt.docids_json = true;
+        } else if (a == "--df-max" && i + 1 < argc) {
+            const long long n = std::atoll(argv[++i]);
+            if (n < DF_MIN_THRESHOLD || n > 0xffffffffll) {
+                std::cerr << "bad --df-max: " << argv[i] << " (min " << DF_MIN_THRESHOLD << ")\n";
+                return 1;
+            }
+            opt.df_max = (std::uint32_t)n;
+        } else if (a == "--df-pct" && i + 1 < argc) {
+            opt.df_pct = std::atof(argv[++i]);
+            if (!(opt.df_pct > 0 && opt.df_pct < 100)) {
+                std::cerr << "bad --df-pct: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (a == "--df-side") {
+            opt.df_side = true;
+        } else if (a == "--segment") {
+            segment = true;
+        } else if (a == "--tombstones" && i + 1 < argc) {
+            tombstones_path = argv[++i];
+        } else if (a == "--postings" && i + 1 < argc) {
+            if (!parse_postings_codec(argv[++i], opt.postings_codec)) {
+                std::cerr << "bad --postings: " << argv[i] << "\n";
+                return 1;
+            }
+        } else {
+            std::cerr << "unknown argument: " << a << "\n";
+            return 1;
+        }
+    }
+
+    if (!tombstones_path.empty() && !segment) {
+        std::cerr << "--tombstones requires --segment\n";
+        return 1;
+    }
+    if (opt.df_side && (!opt.df_prune() || opt.layout != INDEX_LAYOUT_MMAP)) {
+        std::cerr << "--df-side requires --df-max or --df-pct and --format v3\n";
+        return 1;
+    }
+    // Сегмент отсекает по df только внутри своей дельты; выброшенные постинги
+    // --merge уже не вернёт, а в stop_postings они заново отсекаются по df
+    // слитого сегмента.
+    if (segment && opt.df_prune() && !opt.df_side) {
+        std::cerr << "--segment with --df-max/--df-pct requires --df-side\n";
+        return 1;
+    }
+    if (segment && intern) {
+        std::cerr << "--segment is incompatible with --intern: token ids are per-segment\n";
+        return 1;
+    }
+
+    // Обычный файл отображается в память и режется на диапазоны; канал или
+    // устройство читается потоком построчно.
+    std::error_code corpus_ec;
+    const bool map_corpus = fs::is_regular_file(corpus_path, corpus_ec);
+    MappedFile corpus_map;
+    std::ifstream in;
+    if (map_corpus) {
+        std::string err;
+        if (!corpus_map.open(corpus_path.string(), err)) {
+            std::cerr << err << "\n";
+            return 1;
+        }
+        corpus_map.advise(MADV_SEQUENTIAL);
+    } else {
+        in.open(corpus_path);
+        if (!in) {
+            std::cerr << "cannot open " << corpus_path << "\n";
+            return 1;
+        }
+    }
+
+    const fs::path set_dir = out_dir;
+    std::vector<std::string> tombstones;
+    if (segment) {
+        std::string err, name;
+        if ((!tombstones_path.empty() && !read_tombstones_file(tombstones_path, tombstones, err)) ||
+            !reserve_segment(set_dir, index_params_of(opt), segment_config_of(opt), name, err)) {
+            std::cerr << err << "\n";
+            return 1;
+        }
+        out_dir = set_dir / name;
+    }
+    fs::create_directories(out_dir);
+
+    BuildState st;
+    st.docs.reserve(1024);
+    st.infos.reserve(1024);
+    st.post9.recs.reserve(1024 * 64);
+
+    const fs::path spill_dir = out_dir / "spill_runs";
+    const std::size_t spill_records = spill_run_records(opt);
+    if (opt.mem_budget > 0) {
+        st.post9.recs.reserve(spill_records);
+        if (opt.k13) st.post13.recs.reserve(spill_records);
+    }
+    std::string spill_err;
+
+    // Коммит батча; с --mem-budget буфер постингов каждой ширины сбрасывается
+    // прогоном, когда батч в него уже не влезает и после заполнения.
+    DocScratch commit_sc;
+    TokenIdAssigner assigner(st.dict);
+    TokenIdAssigner* const ids = opt.intern ? &assigner : nullptr;
+    // false — ошибка сброса; прогон пишется, если к буферу не добавить
+    // incoming записей без превышения порога
+    auto spill_unless_fits = [&](PostingList& pl, std::size_t incoming) {
+        return pl.recs.size() + incoming <= spill_records ||
+               spill_postings(spill_dir, (unsigned)threads, pl, spill_err);
+    };
+    auto commit = [&](BatchOut& out) {
+        if (!spill_err.empty()) return;  // дочитываем вход, чтобы остановить конвейер
+        if (opt.mem_budget > 0 &&
+            (!spill_unless_fits(st.post9, out.postings.size()) ||
+             !spill_unless_fits(st.post13, out.postings13.size())))
+            return;
+        commit_batch(out, st);
+        if (opt.mem_budget > 0 && spill_unless_fits(st.post9, 1))
+            spill_unless_fits(st.post13, 1);
+    };
+
+    // Батчи в порядке файла: строки из потока или диапазоны отображения
+    // (строки в них воркер находит сам). Возвращает число батчей.
+    auto feed_batches = [&](auto&& on_batch) -> std::uint64_t {
+        if (!map_corpus) return read_batches(in, on_batch);
+        const std::size_t size = corpus_map.size();
+        std::uint64_t seq = 0;
+        for (std::size_t off = 0; off < size; off += CORPUS_CHUNK_BYTES) {
+            Batch b;
+            b.seq         = seq++;
+            b.corpus      = (const char*)corpus_map.data();
+            b.corpus_size = size;
+            b.begin       = off;
+            b.end         = std::min(size, off + CORPUS_CHUNK_BYTES);
+            on_batch(std::move(b));
+        }
+        return seq;
+    };
+
+    if (threads == 1) {
+        feed_batches([&](Batch&& b) {
+            BatchOut out;
+            process_batch(opt, b, commit_sc, out, ids);
+            commit(out);
+        });
+    } else {
+        BatchPipeline pipe((std::size_t)threads * 4);
+
+        std::vector<std::thread> workers;
+        workers.reserve((std::size_t)threads);
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&] {
+                DocScratch sc;
+                Batch b;
+                while (pipe.next_batch(b)) {
+                    BatchOut out;
+                    process_batch(opt, b, sc, out, ids);
+                    pipe.complete(b.seq, std::move(out));
+                }
+            });
+        }
+        std::thread reader([&] {
+            const std::uint64_t total = feed_batches([&](Batch&& b) { pipe.submit(std::move(b)); });
+            pipe.finish_input(total);
+        });
+
+        BatchOut out;
+        for (std::uint64_t seq = 0; pipe.take(seq, out); ++seq) commit(out);
+
+        reader.join();
+        for (auto& w : workers) w.join();
+    }
+    if (!spill_err.empty()) {
+        std::cerr << spill_err << "\n";
+        return 1;
+    }
+
+    const std::uint64_t skipped_bad_json = st.skipped_bad_json;
+    const std::uint64_t skipped_bad_doc  = st.skipped_bad_doc;
+
+    // сегмент из одних удалений допустим
+    const std::uint32_t N_docs = (std::uint32_t)st.docs.size();
+    if (N_docs == 0 && (!segment || tombstones.empty())) {
+        std::cerr << "no valid docs. skipped_bad_json=" << skipped_bad_json
+                  << " skipped_bad_doc=" << skipped_bad_doc << "\n";
+        return 1;
+    }
+
+    IndexWriteStats ws;
+    {
+        std::string err;
+        if (!write_index_dir(opt, st, out_dir, (unsigned)threads, ws, err) ||
+            (segment && !tombstones.empty() && !write_segment_tombstones(out_dir, tombstones, err)) ||
+            (segment && !publish_segment(set_dir, SegmentEntry{out_dir.filename().string(), segment_level(N_docs), N_docs}, err))) {
+            std::cerr << err << "\n";
             return 1;
         }
-        f << meta.dump();
     }
 
     std::cout << "[index_builder] ok docs=" << N_docs
-              << " post9=" << N_post9
+              << " post9=" << ws.n_post9;
+    if (opt.k13) std::cout << " post13=" << ws.n_post13;
+    if (opt.df_prune()) std::cout << " df_pruned=" << ws.df_pruned;
+    std::cout
               << " skipped_bad_json=" << skipped_bad_json
               << " skipped_bad_doc=" << skipped_bad_doc
+              << " norm=" << norm_mode_name(tp.norm)
+              << " hash=" << hash_family_name(tp.hash)
+              << " vocab=" << (intern ? std::to_string(st.dict.size()) : std::string("-"))
+              << " threads=" << threads
+              << " ingest=" << (map_corpus ? "mmap" : "stream")
+              << " spill_runs=" << st.post9.run_paths.size() + st.post13.run_paths.size()
+              << " postings=" << postings_codec_name(opt.postings_codec)
+              << " postings_bytes=" << ws.postings_bytes
+              << " write_mb=" << (double)ws.write_bytes / (1 << 20)
+              << " index_s=" << ws.index_s
+              << " write_s=" << ws.write_s
+              << " write_mbps=" << ws.write_mbps
               << " out_dir=" << out_dir << "\n";
     return 0;
 }
@@ -0,0 +1,373 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Формат index_native.bin (little-endian, без выравнивания):
+//
+// v1: magic "PLAG", u32 version, u32 N_docs, u64 N_post9, u64 N_post13,
+//     DocMeta[N_docs] (u32 tok_len, u64 simhash_hi, u64 simhash_lo),
+//     postings9[N_post9] (u64 hash, u32 doc), postings13[N_post13].
+// v2: то же, но сразу после заголовка идёт IndexParams (32 байта);
+//     при postings_codec = pfor128 вместо postings9 (с выравниванием на 64
+//     байта) лежит сжатая секция (postings_codec.h), N_post9 — число
+//     постингов в ней;
+//     при dedup = 1 постинги (hash, doc) уникальны, а DocMeta длиннее на
+//     u32 uniq_shingles (24 байта: число различных шинглов в постингах);
+//     при sketch_k > 0 после postings (с выравниванием на 64 байта)
+//     лежат bottom-k скетчи: u64[N_docs][sketch_k].
+//     postings13 (--k13, N_post13 > 0) идут за postings9 в том же виде:
+//     сырые — вплотную, pfor128 — своей сжатой секцией с выравниванием.
+//
+// v3 (--format v3): контейнер для mmap. Заголовок 64 байта (magic, u32
+//     version, u32 N_docs, u32 n_sections, u64 N_post9, u64 N_post13,
+//     IndexParams), за ним каталог IndexSectionEntry[n_sections]
+//     (type, offset, length, checksum), затем секции, каждая с выравниванием
+//     на 64 байта: колонки DocMeta (tok_len u32[], simhash_hi u64[],
+//     simhash_lo u64[], uniq_shingles u32[]), postings9 и postings13,
+//     скетчи, doc id. С --df-side постинги стоп-шинглов (df выше порога)
+//     лежат не в postings, а в stop_postings9/13 в том же кодеке.
+//     Поиск отображает файл и читает секции на месте, без разбора и копий.
+//
+// index_native_meta.bin: колонки метаданных документов для поиска. Заголовок
+//     64 байта (magic "PLMD", u32 version, u32 N_docs, u32 n_sections, нули),
+//     каталог IndexSectionEntry и секции в порядке doc, как в v3: tok_len,
+//     simhash_hi/lo, uniq_shingles (при dedup), title и author (u64
+//     off[N_docs + 1], затем байты строк подряд).
+//
+// index_native_docids.bin: doc id по номеру и обратно. Заголовок как у
+//     index_native_meta.bin (magic "PLID"), секции doc_ids и doc_id_hash —
+//     открытая адресация с линейным пробированием: u32 слотов (степень
+//     двойки, не меньше 2 * N_docs), в слоте doc + 1, 0 — пусто; начальный
+//     слот — старшие биты doc_id_hash(id) * φ.
+//
+// Builder пишет v2 только если параметры отличаются от умолчаний, поэтому
+// индексы со старыми настройками остаются побайтно такими же (v1).
+
+constexpr char          INDEX_MAGIC[4]   = {'P', 'L', 'A', 'G'};
+constexpr std::uint32_t INDEX_VERSION_V1 = 1;
+constexpr std::uint32_t INDEX_VERSION_V2 = 2;
+constexpr std::uint32_t INDEX_VERSION_V3 = 3;
+
+// Параметры, которые обязаны совпадать у builder'а и поиска.
+struct IndexParams {
+    std::uint32_t norm_mode   = 0;   // NormMode
+    std::uint32_t hash_family = 0;   // HashFamily
+    std::uint32_t token_ids   = 0;   // 1: шинглы по id из index_native_dict.bin
+    std::uint32_t winnow_w    = 0;   // 0: все позиции, иначе окно winnowing
+    std::uint32_t sketch_k    = 0;   // 0: без секции скетчей
+    std::uint32_t postings_codec = 0;   // POSTINGS_CODEC_*: 0 — сырые записи
+    std::uint32_t dedup       = 0;   // 1: шинглы уникальны в документе, DocMeta + uniq_shingles
+    std::uint32_t layout      = 0;   // INDEX_LAYOUT_*: записи подряд (v1/v2) или контейнер v3
+
+    bool is_default() const {
+        if (norm_mode != 0 || hash_family != 0 || token_ids != 0 || winnow_w != 0) return false;
+        return sketch_k == 0 && postings_codec == 0 && dedup == 0 && layout == 0;
+    }
+};
+static_assert(sizeof(IndexParams) == 32, "IndexParams is part of the on-disk format");
+
+constexpr std::uint32_t INDEX_LAYOUT_RECORDS = 0;
+constexpr std::uint32_t INDEX_LAYOUT_MMAP    = 1;
+
+struct IndexHeader {
+    std::uint32_t version  = INDEX_VERSION_V1;
+    std::uint32_t n_docs   = 0;
+    std::uint64_t n_post9  = 0;
+    std::uint64_t n_post13 = 0;
+    IndexParams   params;
+    std::uint32_t n_sections = 0;   // v3
+};
+
+// ---- Каталог секций v3 ----
+
+enum class IndexSection : std::uint32_t {
+    DocTokLen       = 1,    // u32[N_docs]
+    DocSimhashHi    = 2,    // u64[N_docs]
+    DocSimhashLo    = 3,    // u64[N_docs]
+    DocUniqShingles = 4,    // u32[N_docs], только при dedup
+    Postings9       = 16,   // PackedPosting[N_post9] или секция pfor128
+    Postings13      = 17,   // как Postings9, при N_post13 > 0
+    StopPostings9   = 18,   // --df-side: отсечённые по df, формат как у Postings9
+    StopPostings13  = 19,
+    Sketches        = 32,   // u64[N_docs][sketch_k]
+    DocIds          = 48,   // u64 off[N_docs + 1], затем байты id подряд
+    DocTitle        = 49,   // index_native_meta.bin, как DocIds
+    DocAuthor       = 50,
+    DocIdHash       = 51,   // index_native_docids.bin: u32 slot[2^b]
+};
+
+inline const char* index_section_name(IndexSection t) {
+    switch (t) {
+        case IndexSection::DocTokLen:       return "doc_tok_len";
+        case IndexSection::DocSimhashHi:    return "doc_simhash_hi";
+        case IndexSection::DocSimhashLo:    return "doc_simhash_lo";
+        case IndexSection::DocUniqShingles: return "doc_uniq_shingles";
+        case IndexSection::Postings9:       return "postings9";
+        case IndexSection::Postings13:      return "postings13";
+        case IndexSection::StopPostings9:   return "stop_postings9";
+        case IndexSection::StopPostings13:  return "stop_postings13";
+        case IndexSection::Sketches:        return "sketches";
+        case IndexSection::DocIds:          return "doc_ids";
+        case IndexSection::DocTitle:        return "doc_title";
+        case IndexSection::DocAuthor:       return "doc_author";
+        case IndexSection::DocIdHash:       return "doc_id_hash";
+    }
+    return "unknown";
+}
+
+struct IndexSectionEntry {
+    std::uint32_t type     = 0;   // IndexSection
+    std::uint32_t flags    = 0;
+    std::uint64_t offset   = 0;   // от начала файла, кратно INDEX_SECTION_ALIGN
+    std::uint64_t length   = 0;   // байт, без выравнивания
+    std::uint64_t checksum = 0;   // index_checksum по length байтам
+};
+static_assert(sizeof(IndexSectionEntry) == 32, "IndexSectionEntry is part of the on-disk format");
+
+constexpr std::uint64_t INDEX_V3_HEADER_BYTES = 64;
+
+constexpr char          DOC_META_MAGIC[4]  = {'P', 'L', 'M', 'D'};
+constexpr std::uint32_t DOC_META_VERSION   = 1;
+constexpr std::uint64_t DOC_META_HEADER_BYTES = 64;
+
+constexpr char          DOC_IDS_MAGIC[4]   = {'P', 'L', 'I', 'D'};
+constexpr std::uint32_t DOC_IDS_VERSION    = 1;
+constexpr std::uint64_t DOC_IDS_HEADER_BYTES = 64;
+
+// FNV-1a по байтам id; слот — старшие bits бит произведения на φ.
+inline std::uint64_t doc_id_hash(const char* p, std::size_t n) {
+    std::uint64_t h = 1469598103934665603ull;
+    for (std::size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+inline std::uint64_t doc_id_slot(std::uint64_t h, std::uint32_t bits) {
+    return bits == 0 ? 0 : (h * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+}
+
+inline std::uint32_t doc_id_table_bits(std::uint64_t n_docs) {
+    std::uint32_t bits = 0;
+    while ((1ull << bits) < 2 * n_docs) ++bits;
+    return bits;
+}
+
+constexpr std::uint64_t INDEX_SECTION_ALIGN   = 64;
+constexpr std::uint64_t INDEX_DOCMETA_BYTES   = 4 + 8 + 8;
+constexpr std::uint64_t INDEX_DOCMETA_DEDUP_BYTES = INDEX_DOCMETA_BYTES + 4;
+constexpr std::uint64_t INDEX_POSTING_BYTES   = 8 + 4;
+
+inline std::uint64_t index_align_up(std::uint64_t off, std::uint64_t a = INDEX_SECTION_ALIGN) {
+    return (off + a - 1) / a * a;
+}
+
+inline std::uint64_t index_header_bytes(const IndexHeader& h) {
+    if (h.version >= INDEX_VERSION_V3) return INDEX_V3_HEADER_BYTES;
+    return 4 + 4 + 4 + 8 + 8 + (h.version >= INDEX_VERSION_V2 ? sizeof(IndexParams) : 0);
+}
+
+// Начало postings9: сразу за DocMeta, сжатая секция — с выравниванием.
+inline std::uint64_t index_docmeta_bytes(const IndexHeader& h) {
+    return h.params.dedup ? INDEX_DOCMETA_DEDUP_BYTES : INDEX_DOCMETA_BYTES;
+}
+
+inline std::uint64_t index_postings_offset(const IndexHeader& h) {
+    const std::uint64_t off = index_header_bytes(h) + (std::uint64_t)h.n_docs * index_docmeta_bytes(h);
+    return h.params.postings_codec != 0 ? index_align_up(off) : off;
+}
+
+// Начало postings13: сразу за postings9, сжатая секция — с выравниванием.
+inline std::uint64_t index_postings13_offset(const IndexHeader& h, std::uint64_t packed_bytes = 0) {
+    if (h.params.postings_codec != 0) return index_align_up(index_postings_offset(h) + packed_bytes);
+    return index_postings_offset(h) + h.n_post9 * INDEX_POSTING_BYTES;
+}
+
+// Конец postings = начало необязательных секций v2. Длины сжатых секций
+// (packed_bytes, packed13_bytes) дают их собственные заголовки.
+inline std::uint64_t index_postings_end(const IndexHeader& h, std::uint64_t packed_bytes = 0,
+                                        std::uint64_t packed13_bytes = 0) {
+    if (h.params.postings_codec != 0) {
+        if (h.n_post13 == 0) return index_postings_offset(h) + packed_bytes;
+        return index_postings13_offset(h, packed_bytes) + packed13_bytes;
+    }
+    return index_postings_offset(h) + (h.n_post9 + h.n_post13) * INDEX_POSTING_BYTES;
+}
+
+inline std::uint64_t index_sketch_offset(const IndexHeader& h, std::uint64_t packed_bytes = 0,
+                                         std::uint64_t packed13_bytes = 0) {
+    return index_align_up(index_postings_end(h, packed_bytes, packed13_bytes));
+}
+
+// Out: std::ostream или BulkWriter (write(const char*, n)).
+template <class Out>
+inline void write_index_header(Out& out, const IndexHeader& h) {
+    out.write(INDEX_MAGIC, 4);
+    out.write((const char*)&h.version,  sizeof(h.version));
+    out.write((const char*)&h.n_docs,   sizeof(h.n_docs));
+    if (h.version >= INDEX_VERSION_V3) {
+        out.write((const char*)&h.n_sections, sizeof(h.n_sections));
+        out.write((const char*)&h.n_post9,    sizeof(h.n_post9));
+        out.write((const char*)&h.n_post13,   sizeof(h.n_post13));
+        out.write((const char*)&h.params,     sizeof(h.params));
+        return;
+    }
+    out.write((const char*)&h.n_post9,  sizeof(h.n_post9));
+    out.write((const char*)&h.n_post13, sizeof(h.n_post13));
+    if (h.version >= INDEX_VERSION_V2)
+        out.write((const char*)&h.params, sizeof(h.params));
+}
+
+inline bool read_index_header(std::istream& in, IndexHeader& h, std::string& err) {
+    char magic[4] = {0, 0, 0, 0};
+    in.read(magic, 4);
+    if (!in || std::memcmp(magic, INDEX_MAGIC, 4) != 0) { err = "bad magic"; return false; }
+
+    in.read((char*)&h.version,  sizeof(h.version));
+    in.read((char*)&h.n_docs,   sizeof(h.n_docs));
+    h.params = IndexParams{};
+    h.n_sections = 0;
+    if (h.version == INDEX_VERSION_V3) {
+        in.read((char*)&h.n_sections, sizeof(h.n_sections));
+        in.read((char*)&h.n_post9,    sizeof(h.n_post9));
+        in.read((char*)&h.n_post13,   sizeof(h.n_post13));
+        in.read((char*)&h.params,     sizeof(h.params));
+        if (!in) { err = "truncated header"; return false; }
+        return true;
+    }
+    in.read((char*)&h.n_post9,  sizeof(h.n_post9));
+    in.read((char*)&h.n_post13, sizeof(h.n_post13));
+    if (!in) { err = "truncated header"; return false; }
+
+    if (h.version == INDEX_VERSION_V1) return true;
+    if (h.version == INDEX_VERSION_V2) {
+        in.read((char*)&h.params, sizeof(h.params));
+        if (!in) { err = "truncated index params"; return false; }
+        return true;
+    }
+    err = "unsupported index version " + std::to_string(h.version);
+    return false;
+}
+
+// Каталог v3: сразу за заголовком (поток стоит после read_index_header).
+inline bool read_index_sections(std::istream& in, const IndexHeader& h,
+                                std::vector<IndexSectionEntry>& sections, std::string& err) {
+    sections.assign(h.n_sections, IndexSectionEntry{});
+    in.read((char*)sections.data(), (std::streamsize)(sections.size() * sizeof(IndexSectionEntry)));
+    if (!in) { err = "truncated section directory"; return false; }
+    return true;
+}
+
+// ---- Контрольная сумма секций v3 ----
+//
+// Сумма (mod 2^64) хэшей 64-байтных блоков, смешанных с номером блока;
+// неполный последний блок дополняется нулями. Блоки независимы: проверку
+// можно делить между потоками, а перезапись блока (заголовок секции,
+// известный только после данных) меняет лишь его слагаемое.
+
+inline std::uint64_t index_mum64(std::uint64_t a, std::uint64_t b) {
+    const __uint128_t r = (__uint128_t)a * b;
+    return (std::uint64_t)r ^ (std::uint64_t)(r >> 64);
+}
+
+inline std::uint64_t index_block_hash(const unsigned char* blk, std::uint64_t idx) {
+    std::uint64_t w[8];
+    std::memcpy(w, blk, 64);
+    const std::uint64_t a = index_mum64(w[0] ^ 0xa0761d6478bd642full, w[1] ^ 0xe7037ed1a0b428dbull);
+    const std::uint64_t b = index_mum64(w[2] ^ 0x8ebc6af09c88c6e3ull, w[3] ^ 0x589965cc75374cc3ull);
+    const std::uint64_t c = index_mum64(w[4] ^ 0x1d8e4e27c47d124full, w[5] ^ 0xa0761d6478bd642full);
+    const std::uint64_t d = index_mum64(w[6] ^ 0xe7037ed1a0b428dbull, w[7] ^ 0x8ebc6af09c88c6e3ull);
+    return index_mum64(a ^ c ^ (idx * 0x9E3779B97F4A7C15ull), b ^ d ^ 0x589965cc75374cc3ull);
+}
+
+class IndexChecksum {
+public:
+    void update(const void* data, std::size_t n) {
+        const unsigned char* p = (const unsigned char*)data;
+        if (used_ > 0) {
+            const std::size_t take = std::min<std::size_t>(n, 64 - used_);
+            std::memcpy(buf_ + used_, p, take);
+            used_ += take; p += take; n -= take;
+            if (used_ < 64) return;
+            sum_ += index_block_hash(buf_, idx_++);
+            used_ = 0;
+        }
+        for (; n >= 64; p += 64, n -= 64) sum_ += index_block_hash(p, idx_++);
+        std::memcpy(buf_, p, n);
+        used_ = n;
+    }
+
+    std::uint64_t digest() const {
+        if (used_ == 0) return sum_;
+        unsigned char tail[64] = {};
+        std::memcpy(tail, buf_, used_);
+        return sum_ + index_block_hash(tail, idx_);
+    }
+
+private:
+    std::uint64_t sum_  = 0;
+    std::uint64_t idx_  = 0;
+    std::size_t   used_ = 0;
+    unsigned char buf_[64];
+};
+
+inline std::uint64_t index_checksum(const void* data, std::size_t n) {
+    IndexChecksum c;
+    c.update(data, n);
+    return c.digest();
+}
+
+// Сумма после замены полного блока idx: old_blk -> new_blk (по 64 байта).
+inline std::uint64_t index_checksum_replace_block(std::uint64_t sum, std::uint64_t idx,
+                                                  const void* old_blk, const void* new_blk) {
+    return sum - index_block_hash((const unsigned char*)old_blk, idx)
+               + index_block_hash((const unsigned char*)new_blk, idx);
+}
+
+// Индекс и запрос должны давать одинаковые хэши токенов: разные режимы
+// нормализации или семейства хэша молча дали бы нулевые совпадения.
+inline bool check_query_compat(const IndexParams& index, const IndexParams& query, std::string& err) {
+    if (index.norm_mode != query.norm_mode) {
+        err = "norm mode mismatch: index=" + std::to_string(index.norm_mode) +
+              " query=" + std::to_string(query.norm_mode);
+        return false;
+    }
+    if (index.hash_family != query.hash_family) {
+        err = "hash family mismatch: index=" + std::to_string(index.hash_family) +
+              " query=" + std::to_string(query.hash_family);
+        return false;
+    }
+    if (index.token_ids != query.token_ids) {
+        err = "token id shingles mismatch: index=" + std::to_string(index.token_ids) +
+              " query=" + std::to_string(query.token_ids);
+        return false;
+    }
+    if (index.postings_codec != query.postings_codec) {
+        err = "postings codec mismatch: index=" + std::to_string(index.postings_codec) +
+              " query=" + std::to_string(query.postings_codec);
+        return false;
+    }
+    if (index.layout != query.layout) {
+        err = "index layout mismatch: index=" + std::to_string(index.layout) +
+              " query=" + std::to_string(query.layout);
+        return false;
+    }
+    if (index.dedup != query.dedup) {
+        err = "docmeta layout mismatch (dedup): index=" + std::to_string(index.dedup) +
+              " query=" + std::to_string(query.dedup);
+        return false;
+    }
+    if (index.winnow_w != query.winnow_w) {
+        err = "winnow window mismatch: index=" + std::to_string(index.winnow_w) +
+              " query=" + std::to_string(query.winnow_w);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,380 @@
+#pragma once
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index_format.h"
+#include "postings_sort.h"
+
+// Файл целиком, отображённый только для чтения.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path, std::string& err) {
+        close();
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { err = "cannot open " + path + ": " + std::strerror(errno); return false; }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) { err = "fstat failed: " + path; ::close(fd); return false; }
+        size_ = (std::size_t)st.st_size;
+        if (size_ == 0) { ::close(fd); return true; }
+        void* p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) { err = "mmap failed: " + path + ": " + std::strerror(errno); size_ = 0; return false; }
+        base_ = (const unsigned char*)p;
+        return true;
+    }
+
+    void close() {
+        if (base_) ::munmap((void*)base_, size_);
+        base_ = nullptr;
+        size_ = 0;
+    }
+
+    const unsigned char* data() const { return base_; }
+    std::size_t size() const { return size_; }
+
+    // madvise на всё отображение (MADV_SEQUENTIAL — однопроходное чтение).
+    void advise(int advice) const {
+        if (base_) ::madvise((void*)base_, size_, advice);
+    }
+
+private:
+    const unsigned char* base_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+// Секция строк (doc_ids, title, author): u64 off[n + 1], затем байты подряд.
+inline std::string_view index_string_at(const unsigned char* s, std::uint64_t n, std::uint32_t i) {
+    const std::uint64_t* off = (const std::uint64_t*)s;
+    const char* pool = (const char*)(off + n + 1);
+    return std::string_view(pool + off[i], (std::size_t)(off[i + 1] - off[i]));
+}
+
+inline bool index_check_strings(const unsigned char* s, std::uint64_t length, std::uint64_t n) {
+    const std::uint64_t off_bytes = (n + 1) * 8;
+    if (length < off_bytes) return false;
+    const std::uint64_t* off = (const std::uint64_t*)s;
+    if (off[0] != 0 || off[n] != length - off_bytes) return false;
+    for (std::uint64_t i = 0; i < n; ++i)
+        if (off[i] > off[i + 1]) return false;
+    return true;
+}
+
+// Отображённый файл с каталогом секций (IndexSectionEntry): общая часть
+// index_native.bin v3 и index_native_meta.bin.
+class MappedSections {
+public:
+    MappedSections() = default;
+    MappedSections(const MappedSections&) = delete;
+    MappedSections& operator=(const MappedSections&) = delete;
+
+    void close() {
+        file_.close();
+        base_ = nullptr;
+        size_ = 0;
+        sections_.clear();
+    }
+
+    const std::vector<IndexSectionEntry>& sections() const { return sections_; }
+    const unsigned char* data() const { return base_; }
+    std::size_t size() const { return size_; }
+
+    const IndexSectionEntry* find(IndexSection t) const {
+        for (const auto& s : sections_)
+            if (s.type == (std::uint32_t)t) return &s;
+        return nullptr;
+    }
+
+    const unsigned char* section_data(IndexSection t, std::uint64_t* length = nullptr) const {
+        const IndexSectionEntry* s = find(t);
+        if (length) *length = s ? s->length : 0;
+        return s ? base_ + s->offset : nullptr;
+    }
+
+    bool verify_checksums(std::string& err) const {
+        for (const auto& s : sections_) {
+            if (index_checksum(base_ + s.offset, (std::size_t)s.length) != s.checksum) {
+                err = std::string("checksum mismatch in section ") + index_section_name((IndexSection)s.type);
+                return false;
+            }
+        }
+        return true;
+    }
+
+protected:
+    MappedFile file_;
+    const unsigned char* base_ = nullptr;
+    std::size_t size_ = 0;
+    std::vector<IndexSectionEntry> sections_;
+
+    bool map(const std::string& path, std::uint64_t header_bytes, std::string& err) {
+        close();
+        if (!file_.open(path, err)) return false;
+        base_ = file_.data();
+        size_ = file_.size();
+        if (size_ < header_bytes) { err = "truncated header"; return false; }
+        return true;
+    }
+
+    // Каталог из n записей сразу за заголовком; секции в границах файла.
+    bool read_directory(std::uint64_t header_bytes, std::uint32_t n, std::string& err) {
+        const std::uint64_t dir_end = header_bytes + (std::uint64_t)n * sizeof(IndexSectionEntry);
+        if (dir_end > size_) { err = "truncated section directory"; return false; }
+        sections_.resize(n);
+        std::memcpy(sections_.data(), base_ + header_bytes, sections_.size() * sizeof(IndexSectionEntry));
+
+        for (const auto& s : sections_) {
+            if (s.offset % INDEX_SECTION_ALIGN != 0 || s.offset < dir_end ||
+                s.offset > size_ || s.length > size_ - s.offset) {
+                err = std::string("bad section ") + index_section_name((IndexSection)s.type);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool need(IndexSection t, std::uint64_t bytes, bool required, std::string& err) const {
+        const IndexSectionEntry* s = find(t);
+        if (!s) {
+            if (required) err = std::string("missing section ") + index_section_name(t);
+            return !required;
+        }
+        if (s->length != bytes) { err = std::string("bad size of section ") + index_section_name(t); return false; }
+        return true;
+    }
+
+    bool need_strings(IndexSection t, std::uint64_t n, bool required, std::string& err) const {
+        const IndexSectionEntry* s = find(t);
+        if (!s) {
+            if (required) err = std::string("missing section ") + index_section_name(t);
+            return !required;
+        }
+        if (!index_check_strings(base_ + s->offset, s->length, n)) {
+            err = std::string("bad offsets in section ") + index_section_name(t);
+            return false;
+        }
+        return true;
+    }
+
+    template <class T>
+    const T* column(IndexSection t) const { return (const T*)section_data(t); }
+};
+
+// Индекс v3, отображённый в память (MAP_SHARED, только чтение): колонки,
+// постинги и doc id читаются прямо из страниц файла. Несколько процессов
+// поиска делят одну копию в page cache; загрузка — проверка заголовка и
+// каталога, без чтения секций.
+
+class MappedIndex : public MappedSections {
+public:
+    // verify: сверить контрольные суммы всех секций (читает весь файл).
+    bool open(const std::string& path, std::string& err, bool verify = false) {
+        if (!map(path, INDEX_V3_HEADER_BYTES, err) || !parse(err) ||
+            (verify && !verify_checksums(err))) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    const IndexHeader& header() const { return hdr_; }
+
+    // Колонки DocMeta (nullptr, если секции нет).
+    const std::uint32_t* tok_len() const       { return column<std::uint32_t>(IndexSection::DocTokLen); }
+    const std::uint64_t* simhash_hi() const    { return column<std::uint64_t>(IndexSection::DocSimhashHi); }
+    const std::uint64_t* simhash_lo() const    { return column<std::uint64_t>(IndexSection::DocSimhashLo); }
+    const std::uint32_t* uniq_shingles() const { return column<std::uint32_t>(IndexSection::DocUniqShingles); }
+    const std::uint64_t* sketches() const      { return column<std::uint64_t>(IndexSection::Sketches); }
+
+    // Сырые postings9/13 (postings_codec = raw); для pfor128 — section_data().
+    const PackedPosting* postings9() const {
+        if (hdr_.params.postings_codec != 0) return nullptr;
+        return (const PackedPosting*)section_data(IndexSection::Postings9);
+    }
+    const PackedPosting* postings13() const {
+        if (hdr_.params.postings_codec != 0) return nullptr;
+        return (const PackedPosting*)section_data(IndexSection::Postings13);
+    }
+
+    std::string_view doc_id(std::uint32_t doc) const {
+        const unsigned char* s = section_data(IndexSection::DocIds);
+        if (!s || doc >= hdr_.n_docs) return {};
+        return index_string_at(s, hdr_.n_docs, doc);
+    }
+
+private:
+    IndexHeader hdr_;
+
+    bool parse(std::string& err) {
+        if (std::memcmp(base_, INDEX_MAGIC, 4) != 0) { err = "bad magic"; return false; }
+        std::memcpy(&hdr_.version, base_ + 4, 4);
+        if (hdr_.version != INDEX_VERSION_V3) {
+            err = "index version " + std::to_string(hdr_.version) + " is not mmap-ready (need v3)";
+            return false;
+        }
+        std::memcpy(&hdr_.n_docs,     base_ + 8,  4);
+        std::memcpy(&hdr_.n_sections, base_ + 12, 4);
+        std::memcpy(&hdr_.n_post9,    base_ + 16, 8);
+        std::memcpy(&hdr_.n_post13,   base_ + 24, 8);
+        std::memcpy(&hdr_.params,     base_ + 32, sizeof(IndexParams));
+        if (!read_directory(INDEX_V3_HEADER_BYTES, hdr_.n_sections, err)) return false;
+
+        // размеры колонок сверяются с заголовком, дальше доступ без проверок
+        const std::uint64_t n = hdr_.n_docs;
+        if (!need(IndexSection::DocTokLen,    n * 4, true, err)) return false;
+        if (!need(IndexSection::DocSimhashHi, n * 8, true, err)) return false;
+        if (!need(IndexSection::DocSimhashLo, n * 8, true, err)) return false;
+        if (!need(IndexSection::DocUniqShingles, n * 4, hdr_.params.dedup != 0, err)) return false;
+        if (!need(IndexSection::Sketches, n * hdr_.params.sketch_k * 8, hdr_.params.sketch_k != 0, err)) return false;
+        if (hdr_.params.postings_codec == 0 &&
+            !need(IndexSection::Postings9, hdr_.n_post9 * INDEX_POSTING_BYTES, true, err)) return false;
+        if (!find(IndexSection::Postings9)) { err = "missing section postings9"; return false; }
+        if (hdr_.n_post13 > 0) {
+            if (!find(IndexSection::Postings13)) { err = "missing section postings13"; return false; }
+            if (hdr_.params.postings_codec == 0 &&
+                !need(IndexSection::Postings13, hdr_.n_post13 * INDEX_POSTING_BYTES, true, err)) return false;
+        }
+        return need_strings(IndexSection::DocIds, n, false, err);
+    }
+};
+
+// index_native_meta.bin: метаданные документов по номеру doc за O(1), без
+// разбора JSON. Строки — string_view в отображение.
+class MappedDocMeta : public MappedSections {
+public:
+    bool open(const std::string& path, std::string& err, bool verify = false) {
+        if (!map(path, DOC_META_HEADER_BYTES, err) || !parse(err) ||
+            (verify && !verify_checksums(err))) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    std::uint32_t n_docs() const { return n_docs_; }
+
+    std::uint32_t tok_len(std::uint32_t doc) const    { return column<std::uint32_t>(IndexSection::DocTokLen)[doc]; }
+    std::uint64_t simhash_hi(std::uint32_t doc) const { return column<std::uint64_t>(IndexSection::DocSimhashHi)[doc]; }
+    std::uint64_t simhash_lo(std::uint32_t doc) const { return column<std::uint64_t>(IndexSection::DocSimhashLo)[doc]; }
+
+    // uniq_shingles есть только у индексов с dedup
+    bool has_uniq_shingles() const { return find(IndexSection::DocUniqShingles) != nullptr; }
+    std::uint32_t uniq_shingles(std::uint32_t doc) const {
+        const std::uint32_t* c = column<std::uint32_t>(IndexSection::DocUniqShingles);
+        return c ? c[doc] : 0;
+    }
+
+    std::string_view title(std::uint32_t doc) const  { return strings(IndexSection::DocTitle, doc); }
+    std::string_view author(std::uint32_t doc) const { return strings(IndexSection::DocAuthor, doc); }
+
+private:
+    std::uint32_t n_docs_ = 0;
+
+    std::string_view strings(IndexSection t, std::uint32_t doc) const {
+        const unsigned char* s = section_data(t);
+        if (!s || doc >= n_docs_) return {};
+        return index_string_at(s, n_docs_, doc);
+    }
+
+    bool parse(std::string& err) {
+        if (std::memcmp(base_, DOC_META_MAGIC, 4) != 0) { err = "bad magic"; return false; }
+        std::uint32_t version = 0, n_sections = 0;
+        std::memcpy(&version,    base_ + 4,  4);
+        std::memcpy(&n_docs_,    base_ + 8,  4);
+        std::memcpy(&n_sections, base_ + 12, 4);
+        if (version != DOC_META_VERSION) {
+            err = "unsupported doc meta version " + std::to_string(version);
+            return false;
+        }
+        if (!read_directory(DOC_META_HEADER_BYTES, n_sections, err)) return false;
+
+        const std::uint64_t n = n_docs_;
+        if (!need(IndexSection::DocTokLen,    n * 4, true, err)) return false;
+        if (!need(IndexSection::DocSimhashHi, n * 8, true, err)) return false;
+        if (!need(IndexSection::DocSimhashLo, n * 8, true, err)) return false;
+        if (!need(IndexSection::DocUniqShingles, n * 4, false, err)) return false;
+        return need_strings(IndexSection::DocTitle, n, true, err) &&
+               need_strings(IndexSection::DocAuthor, n, true, err);
+    }
+};
+
+// index_native_docids.bin: doc id по номеру (string_view в отображение) и
+// номер по doc id через хэш-таблицу, без разбора и копий строк.
+class MappedDocIds : public MappedSections {
+public:
+    bool open(const std::string& path, std::string& err, bool verify = false) {
+        if (!map(path, DOC_IDS_HEADER_BYTES, err) || !parse(err) ||
+            (verify && !verify_checksums(err))) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    std::uint32_t n_docs() const { return n_docs_; }
+
+    std::string_view id(std::uint32_t doc) const {
+        if (doc >= n_docs_) return {};
+        return index_string_at(ids_, n_docs_, doc);
+    }
+
+    bool find(std::string_view id, std::uint32_t& doc) const {
+        if (!slots_) return false;
+        const std::uint64_t mask = (1ull << bits_) - 1;
+        std::uint64_t i = doc_id_slot(doc_id_hash(id.data(), id.size()), bits_);
+        for (std::uint64_t probes = 0; probes <= mask; ++probes, i = (i + 1) & mask) {
+            const std::uint32_t v = slots_[i];
+            if (v == 0) return false;
+            if (v - 1 < n_docs_ && index_string_at(ids_, n_docs_, v - 1) == id) {
+                doc = v - 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool contains(std::string_view id) const {
+        std::uint32_t doc;
+        return find(id, doc);
+    }
+
+private:
+    std::uint32_t n_docs_ = 0;
+    std::uint32_t bits_ = 0;
+    const unsigned char* ids_ = nullptr;
+    const std::uint32_t* slots_ = nullptr;
+
+    bool parse(std::string& err) {
+        if (std::memcmp(base_, DOC_IDS_MAGIC, 4) != 0) { err = "bad magic"; return false; }
+        std::uint32_t version = 0, n_sections = 0;
+        std::memcpy(&version,    base_ + 4,  4);
+        std::memcpy(&n_docs_,    base_ + 8,  4);
+        std::memcpy(&n_sections, base_ + 12, 4);
+        if (version != DOC_IDS_VERSION) {
+            err = "unsupported doc ids version " + std::to_string(version);
+            return false;
+        }
+        if (!read_directory(DOC_IDS_HEADER_BYTES, n_sections, err)) return false;
+
+        bits_ = doc_id_table_bits(n_docs_);
+        if (!need_strings(IndexSection::DocIds, n_docs_, true, err)) return false;
+        if (!need(IndexSection::DocIdHash, (4ull << bits_), true, err)) return false;
+        ids_   = section_data(IndexSection::DocIds);
+        slots_ = column<std::uint32_t>(IndexSection::DocIdHash);
+        return true;
+    }
+};
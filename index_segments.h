@@ -0,0 +1,464 @@
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+#include "index_format.h"
+#include "index_mmap.h"
+#include "postings_codec.h"
+#include "postings_sort.h"
+
+// Набор сегментов: каталог с segments.json и подкаталогами seg_NNNNNN,
+// каждый — обычный каталог индекса (index_native.bin, docids, meta).
+//
+// Сегменты упорядочены от старых к новым. Документ сегмента жив, если ни
+// один более новый сегмент не содержит тот же doc_id (новая версия) и не
+// перечисляет его в index_tombstones.json (удаление). Builder с --segment
+// дописывает в конец дельту по изменённым документам; --merge сливает
+// подряд идущие сегменты одного уровня в один, выбрасывая мёртвые
+// документы, как компакция в LSM. Все сегменты набора обязаны иметь
+// одинаковые IndexParams и SegmentBuildConfig.
+
+constexpr const char* SEGMENT_MANIFEST   = "segments.json";
+constexpr const char* SEGMENT_LOCK       = "segments.lock";
+constexpr const char* SEGMENT_TOMBSTONES = "index_tombstones.json";
+constexpr std::size_t SEGMENT_MERGE_FANOUT = 4;   // столько сегментов уровня сливаются в один
+constexpr std::uint32_t SEGMENT_LEVEL0_DOCS = 1024;   // сегменты меньше — уровень 0
+
+// Уровень по размеру (size-tiered): каждый следующий в FANOUT раз крупнее.
+// Полная сборка сразу попадает на свой уровень и не переписывается
+// вместе с мелкими дельтами.
+inline std::uint32_t segment_level(std::uint32_t n_docs) {
+    std::uint32_t level = 0;
+    for (std::uint64_t cap = SEGMENT_LEVEL0_DOCS; n_docs >= cap; cap *= SEGMENT_MERGE_FANOUT) level++;
+    return level;
+}
+
+struct SegmentEntry {
+    std::string   name;
+    std::uint32_t level  = 0;
+    std::uint32_t n_docs = 0;
+};
+
+struct SegmentManifest {
+    std::uint64_t next_id = 1;   // номер следующего seg_NNNNNN, резервируется под блокировкой
+    std::vector<SegmentEntry> segments;
+};
+
+inline std::string segment_name(std::uint64_t id) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "seg_%06llu", (unsigned long long)id);
+    return buf;
+}
+
+inline bool is_segment_set(const std::filesystem::path& dir) {
+    std::error_code ec;
+    return std::filesystem::exists(dir / SEGMENT_MANIFEST, ec);
+}
+
+// Нет segments.json — пустой набор.
+inline bool load_segment_manifest(const std::filesystem::path& dir, SegmentManifest& m, std::string& err) {
+    m = SegmentManifest{};
+    const std::filesystem::path p = dir / SEGMENT_MANIFEST;
+    std::ifstream f(p);
+    if (!f) return true;
+    try {
+        const nlohmann::json j = nlohmann::json::parse(f);
+        m.next_id = j.at("next_id").get<std::uint64_t>();
+        for (const auto& s : j.at("segments")) {
+            SegmentEntry e;
+            e.name   = s.at("name").get<std::string>();
+            e.level  = s.value("level", 0u);
+            e.n_docs = s.value("n_docs", 0u);
+            m.segments.push_back(std::move(e));
+        }
+    } catch (const std::exception& e) {
+        err = p.string() + ": " + e.what();
+        return false;
+    }
+    return true;
+}
+
+// Запись через временный файл и rename: читатель видит старый или новый набор.
+inline bool save_segment_manifest(const std::filesystem::path& dir, const SegmentManifest& m, std::string& err) {
+    nlohmann::json segs = nlohmann::json::array();
+    for (const auto& e : m.segments)
+        segs.push_back({{"name", e.name}, {"level", e.level}, {"n_docs", e.n_docs}});
+    const nlohmann::json j = {{"next_id", m.next_id}, {"segments", std::move(segs)}};
+
+    const std::filesystem::path p   = dir / SEGMENT_MANIFEST;
+    const std::filesystem::path tmp = dir / (std::string(SEGMENT_MANIFEST) + ".tmp");
+    {
+        std::ofstream f(tmp);
+        if (!f) { err = "cannot open " + tmp.string() + " for write"; return false; }
+        f << j.dump();
+        if (!f) { err = "write failed: " + tmp.string(); return false; }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, p, ec);
+    if (ec) { err = "cannot rename " + tmp.string() + ": " + ec.message(); return false; }
+    return true;
+}
+
+// Эксклюзивная блокировка segments.json (flock) на время чтения-изменения-записи.
+class SegmentSetLock {
+public:
+    SegmentSetLock() = default;
+    SegmentSetLock(const SegmentSetLock&) = delete;
+    SegmentSetLock& operator=(const SegmentSetLock&) = delete;
+    ~SegmentSetLock() { unlock(); }
+
+    bool lock(const std::filesystem::path& dir, std::string& err) {
+        const std::string p = (dir / SEGMENT_LOCK).string();
+        fd_ = ::open(p.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) { err = "cannot open " + p + ": " + std::strerror(errno); return false; }
+        while (::flock(fd_, LOCK_EX) != 0) {
+            if (errno == EINTR) continue;
+            err = "flock failed: " + p + ": " + std::strerror(errno);
+            unlock();
+            return false;
+        }
+        return true;
+    }
+
+    void unlock() {
+        if (fd_ >= 0) ::close(fd_);   // close снимает flock
+        fd_ = -1;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+// ---- doc id, tombstones, живые документы ----
+
+inline bool read_json_strings(const std::filesystem::path& p, std::vector<std::string>& out, std::string& err) {
+    std::ifstream f(p);
+    if (!f) { err = "cannot open " + p.string(); return false; }
+    try {
+        out = nlohmann::json::parse(f).get<std::vector<std::string>>();
+    } catch (const std::exception& e) {
+        err = p.string() + ": " + e.what();
+        return false;
+    }
+    return true;
+}
+
+// Нет файла — нет удалений.
+inline bool read_segment_tombstones(const std::filesystem::path& seg_dir, std::vector<std::string>& out, std::string& err) {
+    out.clear();
+    std::error_code ec;
+    if (!std::filesystem::exists(seg_dir / SEGMENT_TOMBSTONES, ec)) return true;
+    return read_json_strings(seg_dir / SEGMENT_TOMBSTONES, out, err);
+}
+
+inline bool write_segment_tombstones(const std::filesystem::path& seg_dir, const std::vector<std::string>& ids, std::string& err) {
+    const std::filesystem::path p = seg_dir / SEGMENT_TOMBSTONES;
+    std::ofstream f(p);
+    if (!f) { err = "cannot open " + p.string() + " for write"; return false; }
+    f << nlohmann::json(ids).dump();
+    return true;
+}
+
+// doc id сегмента: index_native_docids.bin, у старых сегментов — JSON.
+inline bool read_segment_doc_ids(const std::filesystem::path& seg_dir, std::vector<std::string>& out, std::string& err) {
+    std::error_code ec;
+    if (!std::filesystem::exists(seg_dir / "index_native_docids.bin", ec))
+        return read_json_strings(seg_dir / "index_native_docids.json", out, err);
+    MappedDocIds ids;
+    if (!ids.open((seg_dir / "index_native_docids.bin").string(), err)) {
+        err = seg_dir.string() + "/index_native_docids.bin: " + err;
+        return false;
+    }
+    out.resize(ids.n_docs());
+    for (std::uint32_t i = 0; i < ids.n_docs(); ++i) out[i].assign(ids.id(i));
+    return true;
+}
+
+struct SegmentDocs {
+    std::vector<std::string>  doc_ids;
+    std::vector<std::string>  tombstones;
+    std::vector<std::uint8_t> live;   // по doc_ids
+    std::uint32_t             n_live = 0;
+};
+
+// doc id и tombstones всех сегментов; живость — проходом от новых к старым.
+inline bool load_segment_docs(const std::filesystem::path& set_dir, const SegmentManifest& m,
+                              std::vector<SegmentDocs>& out, std::string& err) {
+    out.assign(m.segments.size(), SegmentDocs{});
+    for (std::size_t s = 0; s < m.segments.size(); ++s) {
+        const std::filesystem::path dir = set_dir / m.segments[s].name;
+        if (!read_segment_doc_ids(dir, out[s].doc_ids, err)) return false;
+        if (!read_segment_tombstones(dir, out[s].tombstones, err)) return false;
+    }
+
+    std::unordered_set<std::string> shadow;
+    for (std::size_t s = out.size(); s-- > 0;) {
+        SegmentDocs& sd = out[s];
+        sd.live.assign(sd.doc_ids.size(), 0);
+        sd.n_live = 0;
+        for (std::size_t i = 0; i < sd.doc_ids.size(); ++i) {
+            if (shadow.count(sd.doc_ids[i])) continue;
+            sd.live[i] = 1;
+            sd.n_live++;
+        }
+        shadow.insert(sd.doc_ids.begin(), sd.doc_ids.end());
+        shadow.insert(sd.tombstones.begin(), sd.tombstones.end());
+    }
+    return true;
+}
+
+// То же по отображённым таблицам doc id (core_api): вместо множества всех id
+// документ проверяется обратным поиском в более новых сегментах.
+inline void mark_segment_live(const std::vector<const MappedDocIds*>& ids,
+                              const std::vector<std::vector<std::string>>& tombstones,
+                              std::vector<std::vector<std::uint8_t>>& live) {
+    live.assign(ids.size(), {});
+    std::unordered_set<std::string_view> deleted;
+    for (std::size_t s = ids.size(); s-- > 0;) {
+        const MappedDocIds& seg = *ids[s];
+        live[s].assign(seg.n_docs(), 0);
+        for (std::uint32_t i = 0; i < seg.n_docs(); ++i) {
+            const std::string_view id = seg.id(i);
+            bool shadowed = deleted.count(id) != 0;
+            for (std::size_t t = s + 1; t < ids.size() && !shadowed; ++t) shadowed = ids[t]->contains(id);
+            live[s][i] = shadowed ? 0 : 1;
+        }
+        deleted.insert(tombstones[s].begin(), tombstones[s].end());
+    }
+}
+
+// ---- совместимость и план слияния ----
+
+inline bool read_segment_header(const std::filesystem::path& seg_dir, IndexHeader& h, std::string& err) {
+    const std::filesystem::path p = seg_dir / "index_native.bin";
+    std::ifstream f(p, std::ios::binary);
+    if (!f) { err = "missing index_native.bin in " + seg_dir.string(); return false; }
+    if (!read_index_header(f, h, err)) { err = p.string() + ": " + err; return false; }
+    return true;
+}
+
+// Сегменты одного набора сливаются побайтно и ищутся одним ядром, поэтому
+// параметры должны совпадать целиком, включая sketch_k, кодек и раскладку.
+inline bool check_segment_compat(const IndexParams& set, const IndexParams& seg, std::string& err) {
+    if (std::memcmp(&set, &seg, sizeof(IndexParams)) == 0) return true;
+    if (!check_query_compat(seg, set, err)) { err = "segment params differ from set: " + err; return false; }
+    err = "segment params differ from set (winnow/sketch/codec)";
+    return false;
+}
+
+// Настройки сборки вне IndexParams (заголовок не расширить), из "config"
+// в index_native_meta.json. k13 — флаг сборки, а не N_post13 > 0: при
+// --k13 у коротких документов 13-грамм может не быть вовсе. df_* — порог
+// стоп-шинглов: сегменты с разными порогами слились бы в индекс, где
+// отсечение зависит от того, в какой дельте пришёл документ.
+struct SegmentBuildConfig {
+    bool          k13     = false;
+    std::uint32_t df_max  = 0;
+    double        df_pct  = 0;
+    bool          df_side = false;
+
+    bool operator==(const SegmentBuildConfig& o) const {
+        return k13 == o.k13 && df_max == o.df_max && df_pct == o.df_pct && df_side == o.df_side;
+    }
+    bool operator!=(const SegmentBuildConfig& o) const { return !(*this == o); }
+};
+
+// Каталог без index_native_meta.json (старые индексы) — настройки по умолчанию.
+inline bool read_segment_config(const std::filesystem::path& dir, SegmentBuildConfig& c, std::string& err) {
+    c = SegmentBuildConfig{};
+    const std::filesystem::path p = dir / "index_native_meta.json";
+    std::ifstream f(p);
+    if (!f) return true;
+    try {
+        const nlohmann::json j = nlohmann::json::parse(f);
+        const auto it = j.find("config");
+        if (it == j.end()) return true;
+        c.k13     = it->value("k13", false);
+        c.df_max  = it->value("df_max", 0u);
+        c.df_pct  = it->value("df_pct", 0.0);
+        c.df_side = it->value("df_side", false);
+    } catch (const std::exception& e) {
+        err = p.string() + ": " + e.what();
+        return false;
+    }
+    return true;
+}
+
+inline bool check_segment_config(const SegmentBuildConfig& set, const SegmentBuildConfig& seg, std::string& err) {
+    if (set == seg) return true;
+    err = "segment build config differs from set (k13/df_max/df_pct/df_side)";
+    return false;
+}
+
+// Tiered-план: самый низкий уровень, у которого подряд идут не меньше
+// fanout сегментов; сливается вся такая серия. all — весь набор в один.
+// false — сливать нечего.
+inline bool plan_segment_merge(const SegmentManifest& m, std::size_t fanout, bool all,
+                               std::size_t& first, std::size_t& count) {
+    const std::size_t n = m.segments.size();
+    if (all) {
+        first = 0;
+        count = n;
+        return n > 1;
+    }
+    bool found = false;
+    std::uint32_t best_level = 0;
+    for (std::size_t i = 0; i < n;) {
+        std::size_t j = i + 1;
+        while (j < n && m.segments[j].level == m.segments[i].level) ++j;
+        if (j - i >= fanout && (!found || m.segments[i].level < best_level)) {
+            found = true;
+            best_level = m.segments[i].level;
+            first = i;
+            count = j - i;
+        }
+        i = j;
+    }
+    return found;
+}
+
+// ---- чтение сегмента любой версии (v1/v2/v3, raw/pfor128) ----
+
+class SegmentReader {
+public:
+    bool open(const std::filesystem::path& seg_dir, std::string& err) {
+        const std::filesystem::path p = seg_dir / "index_native.bin";
+        if (!read_segment_header(seg_dir, hdr_, err)) return false;
+        const bool packed = hdr_.params.postings_codec != POSTINGS_CODEC_RAW;
+        if (hdr_.version == INDEX_VERSION_V3) {
+            if (!v3_.open(p.string(), err)) return false;
+            postings_   = v3_.section_data(IndexSection::Postings9, &postings_len_);
+            postings13_ = v3_.section_data(IndexSection::Postings13, &postings13_len_);
+            sketches_ = v3_.sketches();
+        } else {
+            if (!file_.open(p.string(), err)) return false;
+            const std::uint64_t size = file_.size();
+            const std::uint64_t off9 = index_postings_offset(hdr_);
+            docmeta_ = file_.data() + index_header_bytes(hdr_);
+            postings_ = file_.data() + off9;
+            if (off9 > size) { err = "truncated " + p.string(); return false; }
+            std::uint64_t packed_bytes = 0, packed13_bytes = 0;
+            if (packed) {
+                PackedPostingsReader r;
+                if (!r.open(postings_, size - off9, err)) return false;
+                packed_bytes = r.header().section_bytes;
+            }
+            const std::uint64_t off13 = index_postings13_offset(hdr_, packed_bytes);
+            if (hdr_.n_post13 > 0) {
+                if (off13 > size) { err = "truncated " + p.string(); return false; }
+                postings13_ = file_.data() + off13;
+                if (packed) {
+                    PackedPostingsReader r;
+                    if (!r.open(postings13_, size - off13, err)) return false;
+                    packed13_bytes = r.header().section_bytes;
+                }
+                postings13_len_ = index_postings_end(hdr_, packed_bytes, packed13_bytes) - off13;
+            }
+            postings_len_ = packed ? packed_bytes : hdr_.n_post9 * INDEX_POSTING_BYTES;
+            if (hdr_.params.sketch_k > 0) {
+                const std::uint64_t off = index_sketch_offset(hdr_, packed_bytes, packed13_bytes);
+                if (off + (std::uint64_t)hdr_.n_docs * hdr_.params.sketch_k * 8 > size) {
+                    err = "truncated sketches in " + p.string();
+                    return false;
+                }
+                sketches_ = (const std::uint64_t*)(file_.data() + off);
+            }
+            if (index_postings_end(hdr_, packed_bytes, packed13_bytes) > size) { err = "truncated " + p.string(); return false; }
+        }
+        if (packed && !packed_.open(postings_, postings_len_, err)) return false;
+        if (packed && postings13_ && !packed13_.open(postings13_, postings13_len_, err)) return false;
+        return true;
+    }
+
+    const IndexHeader& header() const { return hdr_; }
+
+    std::uint32_t tok_len(std::uint32_t i) const {
+        if (!docmeta_) return v3_.tok_len()[i];
+        return field<std::uint32_t>(i, 0);
+    }
+    std::uint64_t simhash_hi(std::uint32_t i) const {
+        if (!docmeta_) return v3_.simhash_hi()[i];
+        return field<std::uint64_t>(i, 4);
+    }
+    std::uint64_t simhash_lo(std::uint32_t i) const {
+        if (!docmeta_) return v3_.simhash_lo()[i];
+        return field<std::uint64_t>(i, 12);
+    }
+    std::uint32_t uniq_shingles(std::uint32_t i) const {
+        if (!hdr_.params.dedup) return 0;
+        if (!docmeta_) return v3_.uniq_shingles()[i];
+        return field<std::uint32_t>(i, 20);
+    }
+
+    // u64[N_docs][sketch_k] или nullptr.
+    const std::uint64_t* sketches() const { return sketches_; }
+
+    // f(hash, doc) в порядке (hash, doc).
+    template <class F>
+    void for_each_posting(F&& f) const {
+        if (hdr_.params.postings_codec != POSTINGS_CODEC_RAW) { packed_.for_each(f); return; }
+        const PackedPosting* p = (const PackedPosting*)postings_;
+        for (std::uint64_t i = 0; i < hdr_.n_post9; ++i) f(p[i].hash, p[i].doc);
+    }
+
+    // То же для postings13 (пусто, если сегмент собран без --k13).
+    template <class F>
+    void for_each_posting13(F&& f) const {
+        if (!postings13_) return;
+        if (hdr_.params.postings_codec != POSTINGS_CODEC_RAW) { packed13_.for_each(f); return; }
+        const PackedPosting* p = (const PackedPosting*)postings13_;
+        for (std::uint64_t i = 0; i < hdr_.n_post13; ++i) f(p[i].hash, p[i].doc);
+    }
+
+    // Стоп-шинглы --df-side (StopPostings9/13, только v3), тем же кодеком.
+    template <class F>
+    bool for_each_stop_posting(IndexSection t, F&& f, std::string& err) const {
+        if (hdr_.version != INDEX_VERSION_V3) return true;
+        std::uint64_t len = 0;
+        const unsigned char* s = v3_.section_data(t, &len);
+        if (!s) return true;
+        if (hdr_.params.postings_codec != POSTINGS_CODEC_RAW) {
+            PackedPostingsReader r;
+            if (!r.open(s, len, err)) return false;
+            r.for_each(f);
+            return true;
+        }
+        if (len % INDEX_POSTING_BYTES != 0) { err = std::string("bad section ") + index_section_name(t); return false; }
+        const PackedPosting* p = (const PackedPosting*)s;
+        for (std::uint64_t i = 0; i < len / INDEX_POSTING_BYTES; ++i) f(p[i].hash, p[i].doc);
+        return true;
+    }
+
+private:
+    IndexHeader          hdr_;
+    MappedIndex          v3_;
+    MappedFile           file_;
+    const unsigned char* docmeta_  = nullptr;   // v1/v2: записи DocMeta
+    const unsigned char* postings_ = nullptr;
+    std::uint64_t        postings_len_ = 0;
+    const unsigned char* postings13_ = nullptr;
+    std::uint64_t        postings13_len_ = 0;
+    const std::uint64_t* sketches_ = nullptr;
+    PackedPostingsReader packed_;
+    PackedPostingsReader packed13_;
+
+    template <class T>
+    T field(std::uint32_t i, std::size_t off) const {
+        T v;
+        std::memcpy(&v, docmeta_ + (std::size_t)i * index_docmeta_bytes(hdr_) + off, sizeof(T));
+        return v;
+    }
+};
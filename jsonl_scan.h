@@ -0,0 +1,355 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Разбор строки корпуса без DOM: один проход по строке проверяет JSON
+// целиком (как nlohmann: строгая грамматика, UTF-8 по RFC 3629, escape и
+// суррогатные пары) и достаёт doc_id, text, title, author. Строка без
+// escape отдаётся string_view прямо в исходную строку; с escape —
+// раскодируется в переиспользуемый буфер.
+//
+// false — быстрый путь не берётся решать (ошибка, дубликат или не строка
+// у нужного ключа, escape в ключе, экспонента в числе, BOM, глубина):
+// вызывающий разбирает строку nlohmann и получает его же ответ.
+
+struct JsonlDocFields {
+    std::string_view doc_id;
+    std::string_view text;
+    std::string_view title;
+    std::string_view author;
+};
+
+// Раскодированные строки с escape; живут до следующего разбора.
+struct JsonlScanBuffers {
+    std::string doc_id;
+    std::string text;
+    std::string title;
+    std::string author;
+};
+
+namespace jsonl_detail {
+
+constexpr int MAX_DEPTH = 512;
+constexpr std::size_t MAX_NUMBER_CHARS = 64;   // длиннее — пусть решает nlohmann (переполнение double)
+
+inline bool is_ws(unsigned char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+inline int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+class Scanner {
+public:
+    Scanner(const char* p, std::size_t n)
+        : p_((const unsigned char*)p), end_((const unsigned char*)p + n) {}
+
+    bool scan(JsonlDocFields& f, JsonlScanBuffers& buf) {
+        skip_ws();
+        if (p_ == end_ || *p_ != '{') return false;
+        ++p_;
+        skip_ws();
+        if (p_ < end_ && *p_ == '}') {
+            ++p_;
+        } else {
+            unsigned seen = 0;
+            for (;;) {
+                std::string_view key;
+                bool esc = false;
+                if (!scan_string(key, esc) || esc) return false;
+                skip_ws();
+                if (p_ == end_ || *p_ != ':') return false;
+                ++p_;
+                skip_ws();
+
+                const int field = field_index(key);
+                if (field >= 0) {
+                    if (seen & (1u << field)) return false;
+                    seen |= 1u << field;
+                    std::string_view raw;
+                    if (!scan_string(raw, esc)) return false;
+                    std::string_view* dst[4] = {&f.doc_id, &f.text, &f.title, &f.author};
+                    std::string* tmp[4] = {&buf.doc_id, &buf.text, &buf.title, &buf.author};
+                    if (esc) {
+                        unescape(raw, *tmp[field]);
+                        *dst[field] = *tmp[field];
+                    } else {
+                        *dst[field] = raw;
+                    }
+                } else if (!skip_value(1)) {
+                    return false;
+                }
+
+                skip_ws();
+                if (p_ == end_) return false;
+                if (*p_ == ',') { ++p_; skip_ws(); continue; }
+                if (*p_ == '}') { ++p_; break; }
+                return false;
+            }
+        }
+        skip_ws();
+        return p_ == end_;
+    }
+
+private:
+    const unsigned char* p_;
+    const unsigned char* end_;
+
+    static int field_index(std::string_view k) {
+        if (k == "doc_id") return 0;
+        if (k == "text")   return 1;
+        if (k == "title")  return 2;
+        if (k == "author") return 3;
+        return -1;
+    }
+
+    void skip_ws() {
+        while (p_ < end_ && is_ws(*p_)) ++p_;
+    }
+
+    // p_ на открывающей кавычке; raw — байты между кавычками.
+    bool scan_string(std::string_view& raw, bool& esc) {
+        if (p_ == end_ || *p_ != '"') return false;
+        const unsigned char* start = ++p_;
+        esc = false;
+        for (;;) {
+#ifdef __SSE2__
+            // 16 байт за шаг, пока нет кавычки, '\\', управляющих и не-ASCII
+            const __m128i quote = _mm_set1_epi8('"');
+            const __m128i bslash = _mm_set1_epi8('\\');
+            const __m128i space = _mm_set1_epi8(0x20);
+            while (end_ - p_ >= 16) {
+                const __m128i v = _mm_loadu_si128((const __m128i*)p_);
+                const __m128i special = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+                    _mm_cmplt_epi8(v, space));   // знаковое: < 0x20 и >= 0x80
+                const int mask = _mm_movemask_epi8(special);
+                if (mask == 0) { p_ += 16; continue; }
+                p_ += __builtin_ctz((unsigned)mask);
+                break;
+            }
+#endif
+            // скалярно — до первого обычного ASCII-байта: многобайтовые символы
+            // (кириллица) идут подряд, и SIMD-проба после каждого дороже проверки
+            for (;;) {
+                if (p_ == end_) return false;
+                const unsigned char c = *p_;
+                if (c >= 0xC2 && c <= 0xDF) {
+                    if (end_ - p_ < 2 || (p_[1] & 0xC0) != 0x80) return false;
+                    p_ += 2;
+                } else if (c >= 0x80) {
+                    if (!scan_utf8()) return false;
+                } else if (c == '"') {
+                    raw = std::string_view((const char*)start, (std::size_t)(p_ - start));
+                    ++p_;
+                    return true;
+                } else if (c == '\\') {
+                    esc = true;
+                    if (!scan_escape()) return false;
+                } else if (c < 0x20) {
+                    return false;
+                } else {
+                    ++p_;
+                    break;
+                }
+            }
+        }
+    }
+
+    bool scan_hex4(std::uint32_t& v) {
+        if (end_ - p_ < 4) return false;
+        v = 0;
+        for (int i = 0; i < 4; ++i) {
+            const int h = hex_value(p_[i]);
+            if (h < 0) return false;
+            v = (v << 4) | (std::uint32_t)h;
+        }
+        p_ += 4;
+        return true;
+    }
+
+    // p_ на '\\'.
+    bool scan_escape() {
+        if (end_ - p_ < 2) return false;
+        const unsigned char e = p_[1];
+        p_ += 2;
+        switch (e) {
+        case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+            return true;
+        case 'u': {
+            std::uint32_t cp = 0;
+            if (!scan_hex4(cp)) return false;
+            if (cp >= 0xDC00 && cp <= 0xDFFF) return false;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                if (end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u') return false;
+                p_ += 2;
+                std::uint32_t lo = 0;
+                if (!scan_hex4(lo) || lo < 0xDC00 || lo > 0xDFFF) return false;
+            }
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    // Корректная последовательность UTF-8 (без overlong, суррогатов и > U+10FFFF).
+    bool scan_utf8() {
+        const unsigned char c = *p_;
+        int n = 0;
+        unsigned char lo = 0x80, hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF)      n = 1;
+        else if (c == 0xE0)              { n = 2; lo = 0xA0; }
+        else if (c >= 0xE1 && c <= 0xEC) n = 2;
+        else if (c == 0xED)              { n = 2; hi = 0x9F; }
+        else if (c >= 0xEE && c <= 0xEF) n = 2;
+        else if (c == 0xF0)              { n = 3; lo = 0x90; }
+        else if (c >= 0xF1 && c <= 0xF3) n = 3;
+        else if (c == 0xF4)              { n = 3; hi = 0x8F; }
+        else return false;
+        if (end_ - p_ <= n) return false;
+        if (p_[1] < lo || p_[1] > hi) return false;
+        for (int i = 2; i <= n; ++i)
+            if (p_[i] < 0x80 || p_[i] > 0xBF) return false;
+        p_ += n + 1;
+        return true;
+    }
+
+    bool skip_literal(const char* lit, std::size_t n) {
+        if ((std::size_t)(end_ - p_) < n || std::memcmp(p_, lit, n) != 0) return false;
+        p_ += n;
+        return true;
+    }
+
+    bool skip_number() {
+        const unsigned char* start = p_;
+        if (p_ < end_ && *p_ == '-') ++p_;
+        if (p_ == end_) return false;
+        if (*p_ == '0') {
+            ++p_;
+        } else if (*p_ >= '1' && *p_ <= '9') {
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') ++p_;
+        } else {
+            return false;
+        }
+        if (p_ < end_ && *p_ == '.') {
+            ++p_;
+            if (p_ == end_ || *p_ < '0' || *p_ > '9') return false;
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') ++p_;
+        }
+        if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) return false;
+        return (std::size_t)(p_ - start) <= MAX_NUMBER_CHARS;
+    }
+
+    bool skip_value(int depth) {
+        if (depth > MAX_DEPTH || p_ == end_) return false;
+        std::string_view raw;
+        bool esc = false;
+        switch (*p_) {
+        case '"': return scan_string(raw, esc);
+        case 't': return skip_literal("true", 4);
+        case 'f': return skip_literal("false", 5);
+        case 'n': return skip_literal("null", 4);
+        case '{': case '[': {
+            const unsigned char close = *p_ == '{' ? '}' : ']';
+            const bool object = close == '}';
+            ++p_;
+            skip_ws();
+            if (p_ < end_ && *p_ == close) { ++p_; return true; }
+            for (;;) {
+                if (object) {
+                    if (!scan_string(raw, esc)) return false;
+                    skip_ws();
+                    if (p_ == end_ || *p_ != ':') return false;
+                    ++p_;
+                    skip_ws();
+                }
+                if (!skip_value(depth + 1)) return false;
+                skip_ws();
+                if (p_ == end_) return false;
+                if (*p_ == ',') { ++p_; skip_ws(); continue; }
+                if (*p_ == close) { ++p_; return true; }
+                return false;
+            }
+        }
+        default:
+            return skip_number();
+        }
+    }
+
+    static char* put_utf8(std::uint32_t cp, char* o) {
+        if (cp < 0x80) {
+            *o++ = (char)cp;
+        } else if (cp < 0x800) {
+            *o++ = (char)(0xC0 | (cp >> 6));
+            *o++ = (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            *o++ = (char)(0xE0 | (cp >> 12));
+            *o++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *o++ = (char)(0x80 | (cp & 0x3F));
+        } else {
+            *o++ = (char)(0xF0 | (cp >> 18));
+            *o++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+            *o++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *o++ = (char)(0x80 | (cp & 0x3F));
+        }
+        return o;
+    }
+
+    static std::uint32_t hex4(const char* h) {
+        std::uint32_t v = 0;
+        for (int i = 0; i < 4; ++i) v = (v << 4) | (std::uint32_t)hex_value((unsigned char)h[i]);
+        return v;
+    }
+
+    // raw уже проверен scan_string. Раскодированная строка не длиннее
+    // исходной (\uXXXX — 6 байт на не больше чем 3), поэтому пишем в
+    // буфер размера raw и потом обрезаем.
+    static void unescape(std::string_view raw, std::string& out) {
+        out.resize(raw.size());
+        char* o = &out[0];
+        const char* p = raw.data();
+        const char* e = p + raw.size();
+        while (p < e) {
+            if (*p != '\\') { *o++ = *p++; continue; }
+            const char c = p[1];
+            p += 2;
+            switch (c) {
+            case 'b': *o++ = '\b'; break;
+            case 'f': *o++ = '\f'; break;
+            case 'n': *o++ = '\n'; break;
+            case 'r': *o++ = '\r'; break;
+            case 't': *o++ = '\t'; break;
+            case 'u': {
+                std::uint32_t cp = hex4(p);
+                p += 4;
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (hex4(p + 2) - 0xDC00);
+                    p += 6;
+                }
+                o = put_utf8(cp, o);
+                break;
+            }
+            default: *o++ = c; break;   // " \ /
+            }
+        }
+        out.resize((std::size_t)(o - out.data()));
+    }
+};
+
+} // namespace jsonl_detail
+
+// Нужные поля, отсутствующие в строке, остаются пустыми.
+inline bool jsonl_scan_doc(std::string_view line, JsonlDocFields& f, JsonlScanBuffers& buf) {
+    f = JsonlDocFields{};
+    return jsonl_detail::Scanner(line.data(), line.size()).scan(f, buf);
+}
@@ -0,0 +1,441 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "postings_sort.h"
+
+// Сжатая секция postings (IndexParams.postings_codec = POSTINGS_CODEC_PFOR128).
+//
+// Отсортированные по (hash, doc) постинги режутся на блоки по
+// PACKED_BLOCK_HASHES уникальных хэшей. Блок — четыре потока u32:
+//   1. старшие 32 бита дельт хэшей (первая дельта 0: первый хэш в голове),
+//   2. младшие 32 бита дельт хэшей,
+//   3. df - 1 каждого хэша,
+//   4. списки документов подряд: первый doc списка как есть, дальше дельты
+//      (0 — повтор шингла в том же документе).
+// Каждый поток кодируется чанками PFor по 128 значений (см. pfor_encode_chunk).
+// Поиск хэша: бинарный поиск по голове блока, затем декодирование одного
+// блока. Основная масса шинглов уникальна (df = 1), поэтому дельты хэшей
+// сжимаются наравне со списками документов.
+//
+// Раскладка секции (смещения от её начала, начало выровнено на 64):
+//   PackedPostingsHeader (64 байта),
+//   данные блоков [data_bytes],
+//   PackedBlockHead[n_blocks] с heads_off (выравнивание 64).
+
+constexpr std::uint32_t POSTINGS_CODEC_RAW     = 0;
+constexpr std::uint32_t POSTINGS_CODEC_PFOR128 = 1;
+
+inline const char* postings_codec_name(std::uint32_t c) {
+    return c == POSTINGS_CODEC_PFOR128 ? "pfor128" : "raw";
+}
+
+inline bool parse_postings_codec(std::string_view s, std::uint32_t& c) {
+    if (s == "raw")     { c = POSTINGS_CODEC_RAW;     return true; }
+    if (s == "pfor128") { c = POSTINGS_CODEC_PFOR128; return true; }
+    return false;
+}
+
+constexpr char        PACKED_POSTINGS_MAGIC[4] = {'P', 'P', 'F', 'R'};
+constexpr std::size_t PACKED_BLOCK_HASHES      = 128;
+constexpr std::size_t PFOR_CHUNK               = 128;
+
+struct PackedPostingsHeader {
+    char          magic[4]      = {'P', 'P', 'F', 'R'};
+    std::uint32_t block_hashes  = (std::uint32_t)PACKED_BLOCK_HASHES;
+    std::uint64_t n_hashes      = 0;
+    std::uint64_t n_postings    = 0;
+    std::uint64_t n_blocks      = 0;
+    std::uint64_t data_bytes    = 0;
+    std::uint64_t heads_off     = 0;
+    std::uint64_t section_bytes = 0;
+    std::uint64_t reserved      = 0;
+};
+static_assert(sizeof(PackedPostingsHeader) == 64, "PackedPostingsHeader is part of the on-disk format");
+
+struct PackedBlockHead {
+    std::uint64_t first_hash    = 0;
+    std::uint64_t data_off      = 0;   // от начала данных блоков
+    std::uint64_t posting_start = 0;   // номер первого постинга блока
+};
+static_assert(sizeof(PackedBlockHead) == 24, "PackedBlockHead is part of the on-disk format");
+
+// ---- PFor-чанк: до 128 значений u32 ----
+//
+//   u8 b, u8 n_exc,
+//   младшие b бит всех значений: при n = 128 — BP128 (4 вертикальные
+//   полосы: значение i в полосе i % 4, слово j полосы l лежит u32-словом
+//   4*j + l — одна SSE2-распаковка даёт 4 значения подряд), иначе подряд
+//   LSB-first в ceil(n*b/8) байт,
+//   u8 pos[n_exc], u32 high[n_exc] — исключения: value >> b.
+// b выбирается по минимуму размера с учётом исключений (PForDelta).
+
+inline std::size_t pfor_packed_bytes(std::size_t n, unsigned b) {
+    return n == PFOR_CHUNK ? 16 * (std::size_t)b : (n * b + 7) / 8;
+}
+
+inline unsigned pfor_bit_width(std::uint32_t v) {
+    return v ? 32u - (unsigned)__builtin_clz(v) : 0u;
+}
+
+inline void pfor_encode_chunk(const std::uint32_t* v, std::size_t n, std::vector<std::uint8_t>& out) {
+    std::size_t cnt_width[33] = {};
+    for (std::size_t i = 0; i < n; ++i) cnt_width[pfor_bit_width(v[i])]++;
+
+    unsigned best_b = 32;
+    std::size_t best_cost = pfor_packed_bytes(n, 32), above = 0;
+    for (int b = 31; b >= 0; --b) {
+        above += cnt_width[b + 1];
+        const std::size_t cost = pfor_packed_bytes(n, (unsigned)b) + above * 5;
+        if (cost <= best_cost) { best_cost = cost; best_b = (unsigned)b; }
+    }
+    const unsigned b = best_b;
+    const std::uint32_t mask = b == 32 ? 0xFFFFFFFFu : ((1u << b) - 1);
+
+    std::uint8_t pos[PFOR_CHUNK];
+    std::uint32_t high[PFOR_CHUNK];
+    std::size_t n_exc = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        if (b < 32 && (v[i] >> b) != 0) {
+            pos[n_exc] = (std::uint8_t)i;
+            high[n_exc] = v[i] >> b;
+            n_exc++;
+        }
+    }
+
+    const std::size_t at = out.size();
+    out.resize(at + 2 + pfor_packed_bytes(n, b) + n_exc * 5, 0);
+    std::uint8_t* o = out.data() + at;
+    o[0] = (std::uint8_t)b;
+    o[1] = (std::uint8_t)n_exc;
+    o += 2;
+
+    if (n == PFOR_CHUNK) {
+        for (std::size_t lane = 0; lane < 4; ++lane) {
+            std::uint64_t acc = 0;
+            unsigned bits = 0;
+            std::size_t word = 0;
+            for (std::size_t j = 0; j < 32; ++j) {
+                acc |= (std::uint64_t)(v[4 * j + lane] & mask) << bits;
+                bits += b;
+                if (bits >= 32) {
+                    const std::uint32_t w = (std::uint32_t)acc;
+                    std::memcpy(o + 4 * (4 * word + lane), &w, 4);
+                    word++;
+                    acc >>= 32;
+                    bits -= 32;
+                }
+            }
+        }
+    } else {
+        std::uint64_t acc = 0;
+        unsigned bits = 0;
+        std::uint8_t* p = o;
+        for (std::size_t i = 0; i < n; ++i) {
+            acc |= (std::uint64_t)(v[i] & mask) << bits;
+            bits += b;
+            while (bits >= 8) { *p++ = (std::uint8_t)acc; acc >>= 8; bits -= 8; }
+        }
+        if (bits > 0) *p++ = (std::uint8_t)acc;
+    }
+    o += pfor_packed_bytes(n, b);
+
+    std::memcpy(o, pos, n_exc);
+    o += n_exc;
+    std::memcpy(o, high, n_exc * 4);
+}
+
+inline void bp128_unpack_scalar(const std::uint8_t* in, unsigned b, std::uint32_t* out) {
+    const std::uint32_t mask = b == 32 ? 0xFFFFFFFFu : ((1u << b) - 1);
+    for (std::size_t j = 0; j < 32; ++j) {
+        const std::size_t bit = j * b, w = bit / 32;
+        const unsigned sh = (unsigned)(bit % 32);
+        for (std::size_t lane = 0; lane < 4; ++lane) {
+            std::uint32_t lo = 0, hi = 0;
+            std::memcpy(&lo, in + 4 * (4 * w + lane), 4);
+            std::uint64_t x = lo >> sh;
+            if (sh + b > 32) {
+                std::memcpy(&hi, in + 4 * (4 * (w + 1) + lane), 4);
+                x |= (std::uint64_t)hi << (32 - sh);
+            }
+            out[4 * j + lane] = (std::uint32_t)x & mask;
+        }
+    }
+}
+
+#ifdef __SSE2__
+// Четыре полосы за раз: сдвиги одинаковы во всех полосах, поэтому распаковка
+// идёт 128-битными словами без перестановок.
+inline void bp128_unpack_sse2(const std::uint8_t* in, unsigned b, std::uint32_t* out) {
+    const __m128i* w = (const __m128i*)in;
+    const __m128i mask = _mm_set1_epi32(b == 32 ? -1 : (int)((1u << b) - 1));
+    __m128i cur = _mm_loadu_si128(w++);
+    unsigned used = 0;
+    for (std::size_t j = 0; j < 32; ++j) {
+        __m128i v = _mm_srl_epi32(cur, _mm_cvtsi32_si128((int)used));
+        used += b;
+        if (used >= 32 && j < 31) {
+            used -= 32;
+            cur = _mm_loadu_si128(w++);
+            if (used > 0) v = _mm_or_si128(v, _mm_sll_epi32(cur, _mm_cvtsi32_si128((int)(b - used))));
+        }
+        _mm_storeu_si128((__m128i*)(out + 4 * j), _mm_and_si128(v, mask));
+    }
+}
+#endif
+
+// Декодирует чанк из n значений в out; возвращает указатель за чанком.
+inline const std::uint8_t* pfor_decode_chunk(const std::uint8_t* in, std::size_t n, std::uint32_t* out) {
+    const unsigned b = in[0];
+    const std::size_t n_exc = in[1];
+    in += 2;
+
+    if (b == 0) {
+        std::fill(out, out + n, 0u);
+    } else if (n == PFOR_CHUNK) {
+#ifdef __SSE2__
+        bp128_unpack_sse2(in, b, out);
+#else
+        bp128_unpack_scalar(in, b, out);
+#endif
+    } else {
+        const std::uint32_t mask = b == 32 ? 0xFFFFFFFFu : ((1u << b) - 1);
+        std::uint64_t acc = 0;
+        unsigned bits = 0;
+        const std::uint8_t* p = in;
+        for (std::size_t i = 0; i < n; ++i) {
+            while (bits < b) { acc |= (std::uint64_t)(*p++) << bits; bits += 8; }
+            out[i] = (std::uint32_t)acc & mask;
+            acc >>= b;
+            bits -= b;
+        }
+    }
+    in += pfor_packed_bytes(n, b);
+
+    const std::uint8_t* pos = in;
+    in += n_exc;
+    for (std::size_t e = 0; e < n_exc; ++e) {
+        std::uint32_t high = 0;
+        std::memcpy(&high, in + 4 * e, 4);
+        out[pos[e]] |= high << b;
+    }
+    return in + 4 * n_exc;
+}
+
+inline const std::uint8_t* pfor_skip_chunk(const std::uint8_t* in, std::size_t n) {
+    const unsigned b = in[0];
+    const std::size_t n_exc = in[1];
+    return in + 2 + pfor_packed_bytes(n, b) + n_exc * 5;
+}
+
+// Поток из n значений: чанки по 128, последний короче.
+inline void pfor_encode_stream(const std::uint32_t* v, std::size_t n, std::vector<std::uint8_t>& out) {
+    for (std::size_t i = 0; i < n; i += PFOR_CHUNK)
+        pfor_encode_chunk(v + i, std::min(PFOR_CHUNK, n - i), out);
+}
+
+inline const std::uint8_t* pfor_decode_stream(const std::uint8_t* in, std::size_t n, std::uint32_t* out) {
+    for (std::size_t i = 0; i < n; i += PFOR_CHUNK)
+        in = pfor_decode_chunk(in, std::min(PFOR_CHUNK, n - i), out + i);
+    return in;
+}
+
+// ---- Кодер: постинги в порядке (hash, doc) -> секция ----
+//
+// Out: std::ostream или BulkWriter. Данные блоков пишутся потоком; головы
+// копятся в памяти (24 байта на 128 хэшей) и пишутся в finish(). Заголовок
+// секции вызывающий пишет заглушкой до данных и переписывает результатом
+// finish() (BulkWriter::patch).
+template <class Out>
+class PackedPostingsEncoder {
+public:
+    explicit PackedPostingsEncoder(Out& out) : out_(out) {}
+
+    void add(const PackedPosting* p, std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            if (hashes_.empty() || p[i].hash != hashes_.back()) {
+                if (hashes_.size() == PACKED_BLOCK_HASHES) flush_block();
+                hashes_.push_back(p[i].hash);
+                df_.push_back(0);
+                prev_doc_ = 0;
+            }
+            docs_.push_back(df_.back() == 0 ? p[i].doc : p[i].doc - prev_doc_);
+            prev_doc_ = p[i].doc;
+            df_.back()++;
+            hdr_.n_postings++;
+        }
+    }
+
+    PackedPostingsHeader finish() {
+        flush_block();
+        hdr_.n_blocks  = heads_.size();
+        hdr_.heads_off = (sizeof(PackedPostingsHeader) + hdr_.data_bytes + 63) / 64 * 64;
+        static const char zeros[64] = {};
+        out_.write(zeros, (std::streamsize)(hdr_.heads_off - sizeof(PackedPostingsHeader) - hdr_.data_bytes));
+        out_.write((const char*)heads_.data(), (std::streamsize)(heads_.size() * sizeof(PackedBlockHead)));
+        hdr_.section_bytes = hdr_.heads_off + heads_.size() * sizeof(PackedBlockHead);
+        return hdr_;
+    }
+
+private:
+    Out& out_;
+    PackedPostingsHeader hdr_;
+    std::vector<PackedBlockHead> heads_;
+    std::vector<std::uint64_t> hashes_;
+    std::vector<std::uint32_t> df_;
+    std::vector<std::uint32_t> docs_;
+    std::vector<std::uint32_t> tmp_;
+    std::vector<std::uint8_t>  buf_;
+    std::uint32_t prev_doc_ = 0;
+
+    void flush_block() {
+        const std::size_t m = hashes_.size();
+        if (m == 0) return;
+
+        PackedBlockHead head;
+        head.first_hash    = hashes_[0];
+        head.data_off      = hdr_.data_bytes;
+        head.posting_start = hdr_.n_postings - docs_.size();
+        heads_.push_back(head);
+
+        buf_.clear();
+        tmp_.resize(m);
+        for (std::size_t i = 0; i < m; ++i)
+            tmp_[i] = i ? (std::uint32_t)((hashes_[i] - hashes_[i - 1]) >> 32) : 0;
+        pfor_encode_stream(tmp_.data(), m, buf_);
+        for (std::size_t i = 0; i < m; ++i)
+            tmp_[i] = i ? (std::uint32_t)(hashes_[i] - hashes_[i - 1]) : 0;
+        pfor_encode_stream(tmp_.data(), m, buf_);
+        for (std::size_t i = 0; i < m; ++i) tmp_[i] = df_[i] - 1;
+        pfor_encode_stream(tmp_.data(), m, buf_);
+        pfor_encode_stream(docs_.data(), docs_.size(), buf_);
+
+        out_.write((const char*)buf_.data(), (std::streamsize)buf_.size());
+        hdr_.data_bytes += buf_.size();
+        hdr_.n_hashes   += m;
+        hashes_.clear();
+        df_.clear();
+        docs_.clear();
+    }
+};
+
+// ---- Декодер (для поиска и проверок) ----
+
+// Раскрытый блок: хэши, начала списков (m + 1) и doc id.
+struct PackedBlock {
+    std::vector<std::uint64_t> hashes;
+    std::vector<std::uint32_t> starts;
+    std::vector<std::uint32_t> docs;
+    std::vector<std::uint32_t> tmp;
+};
+
+class PackedPostingsReader {
+public:
+    // sec — начало секции в памяти (mmap или буфер), avail — доступно байт.
+    bool open(const std::uint8_t* sec, std::uint64_t avail, std::string& err) {
+        if (avail < sizeof(PackedPostingsHeader)) { err = "truncated packed postings header"; return false; }
+        std::memcpy(&hdr_, sec, sizeof(hdr_));
+        if (std::memcmp(hdr_.magic, PACKED_POSTINGS_MAGIC, 4) != 0) { err = "bad packed postings magic"; return false; }
+        if (hdr_.block_hashes != PACKED_BLOCK_HASHES) { err = "unsupported packed block size"; return false; }
+        if (hdr_.section_bytes > avail ||
+            hdr_.heads_off + hdr_.n_blocks * sizeof(PackedBlockHead) > hdr_.section_bytes ||
+            sizeof(PackedPostingsHeader) + hdr_.data_bytes > hdr_.heads_off) {
+            err = "truncated packed postings";
+            return false;
+        }
+        data_  = sec + sizeof(PackedPostingsHeader);
+        heads_ = sec + hdr_.heads_off;
+        return true;
+    }
+
+    const PackedPostingsHeader& header() const { return hdr_; }
+
+    PackedBlockHead head(std::uint64_t b) const {
+        PackedBlockHead h;
+        std::memcpy(&h, heads_ + b * sizeof(PackedBlockHead), sizeof(h));
+        return h;
+    }
+
+    std::size_t block_hashes(std::uint64_t b) const {
+        return (std::size_t)std::min<std::uint64_t>(PACKED_BLOCK_HASHES, hdr_.n_hashes - b * PACKED_BLOCK_HASHES);
+    }
+
+    void decode_block(std::uint64_t b, PackedBlock& out) const {
+        const PackedBlockHead h = head(b);
+        const std::size_t m = block_hashes(b);
+        const std::uint8_t* p = data_ + h.data_off;
+
+        out.tmp.resize(2 * m);
+        p = pfor_decode_stream(p, m, out.tmp.data());
+        p = pfor_decode_stream(p, m, out.tmp.data() + m);
+        out.hashes.resize(m);
+        std::uint64_t x = h.first_hash;
+        for (std::size_t i = 0; i < m; ++i) {
+            x += ((std::uint64_t)out.tmp[i] << 32) | out.tmp[m + i];
+            out.hashes[i] = x;
+        }
+
+        out.starts.resize(m + 1);
+        p = pfor_decode_stream(p, m, out.tmp.data());
+        out.starts[0] = 0;
+        for (std::size_t i = 0; i < m; ++i) out.starts[i + 1] = out.starts[i] + out.tmp[i] + 1;
+
+        const std::size_t n_docs = out.starts[m];
+        out.docs.resize(n_docs);
+        pfor_decode_stream(p, n_docs, out.docs.data());
+        for (std::size_t i = 0; i < m; ++i)
+            for (std::size_t k = out.starts[i] + 1; k < out.starts[i + 1]; ++k)
+                out.docs[k] += out.docs[k - 1];
+    }
+
+    // Блок, в котором может лежать hash, или false.
+    bool find_block(std::uint64_t hash, std::uint64_t& b) const {
+        std::uint64_t lo = 0, hi = hdr_.n_blocks;
+        while (lo < hi) {
+            const std::uint64_t mid = lo + (hi - lo) / 2;
+            if (head(mid).first_hash <= hash) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == 0) return false;
+        b = lo - 1;
+        return true;
+    }
+
+    // Документы с данным хэшем по возрастанию (с повторами); false — хэша нет.
+    bool lookup(std::uint64_t hash, std::vector<std::uint32_t>& docs, PackedBlock& blk) const {
+        docs.clear();
+        std::uint64_t b = 0;
+        if (!find_block(hash, b)) return false;
+        decode_block(b, blk);
+        auto it = std::lower_bound(blk.hashes.begin(), blk.hashes.end(), hash);
+        if (it == blk.hashes.end() || *it != hash) return false;
+        const std::size_t i = (std::size_t)(it - blk.hashes.begin());
+        docs.assign(blk.docs.begin() + blk.starts[i], blk.docs.begin() + blk.starts[i + 1]);
+        return true;
+    }
+
+    // f(hash, doc) для всех постингов в порядке (hash, doc).
+    template <class F>
+    void for_each(F&& f) const {
+        PackedBlock blk;
+        for (std::uint64_t b = 0; b < hdr_.n_blocks; ++b) {
+            decode_block(b, blk);
+            for (std::size_t i = 0; i + 1 < blk.starts.size(); ++i)
+                for (std::uint32_t k = blk.starts[i]; k < blk.starts[i + 1]; ++k) f(blk.hashes[i], blk.docs[k]);
+        }
+    }
+
+private:
+    PackedPostingsHeader hdr_;
+    const std::uint8_t*  data_  = nullptr;
+    const std::uint8_t*  heads_ = nullptr;
+};
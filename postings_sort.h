@@ -0,0 +1,235 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Постинг в том же виде, что и на диске (u64 hash, u32 doc — 12 байт без
+// выравнивания): секция postings пишется одним write, а сортировка гоняет
+// по памяти на четверть меньше байт, чем std::pair<u64, u32> (16 байт).
+#pragma pack(push, 1)
+struct PackedPosting {
+    std::uint64_t hash;
+    std::uint32_t doc;
+};
+#pragma pack(pop)
+static_assert(sizeof(PackedPosting) == 12, "PackedPosting is the on-disk posting record");
+
+inline bool posting_less(const PackedPosting& a, const PackedPosting& b) {
+    if (a.hash != b.hash) return a.hash < b.hash;
+    return a.doc < b.doc;
+}
+
+// ---- LSD radix sort по hash ----
+//
+// 4 прохода по 16 бит. На 20M постингов это быстрее, чем 6 x 11 и
+// 8 x 8 бит: проходы по 240 МБ стоят дороже промахов по 65536 корзинам.
+// Каждый проход устойчив, поэтому при входе, упорядоченном по doc (так
+// постинги и набираются), результат совпадает с сортировкой по (hash, doc).
+// Проход параллелится по кускам: поток считает гистограмму своего куска,
+// затем раскладывает его в свои диапазоны корзин — порядок внутри корзины
+// остаётся порядком входа. Проход, где все ключи попали в одну корзину,
+// пропускается.
+//
+// Нужен буфер того же размера (tmp); результат остаётся в v.
+
+constexpr int         RADIX_BITS    = 16;
+constexpr std::size_t RADIX_BUCKETS = std::size_t(1) << RADIX_BITS;
+constexpr int         RADIX_PASSES  = (64 + RADIX_BITS - 1) / RADIX_BITS;
+
+// Меньше этого — один поток: запуск потоков дороже самой сортировки.
+constexpr std::size_t RADIX_MIN_PER_THREAD = std::size_t(1) << 16;
+
+template <class F>
+inline void radix_run_parallel(unsigned threads, F&& f) {
+    if (threads <= 1) { f(0u); return; }
+    std::vector<std::thread> ts;
+    ts.reserve(threads - 1);
+    for (unsigned t = 1; t < threads; ++t) ts.emplace_back(f, t);
+    f(0u);
+    for (auto& t : ts) t.join();
+}
+
+inline void radix_sort_postings(
+    std::vector<PackedPosting>& v,
+    std::vector<PackedPosting>& tmp,
+    unsigned threads = 1
+) {
+    const std::size_t n = v.size();
+    if (n < 2) return;
+
+    threads = std::max(1u, threads);
+    threads = (unsigned)std::min<std::size_t>(threads, std::max<std::size_t>(1, n / RADIX_MIN_PER_THREAD));
+
+    tmp.resize(n);
+    PackedPosting* src = v.data();
+    PackedPosting* dst = tmp.data();
+
+    auto chunk_begin = [&](unsigned t) { return n * t / threads; };
+    std::vector<std::size_t> hist((std::size_t)threads * RADIX_BUCKETS);
+
+    for (int pass = 0; pass < RADIX_PASSES; ++pass) {
+        const int shift = pass * RADIX_BITS;
+
+        std::fill(hist.begin(), hist.end(), 0);
+        radix_run_parallel(threads, [&](unsigned t) {
+            std::size_t* h = hist.data() + (std::size_t)t * RADIX_BUCKETS;
+            const std::size_t e = chunk_begin(t + 1);
+            for (std::size_t i = chunk_begin(t); i < e; ++i)
+                h[(src[i].hash >> shift) & (RADIX_BUCKETS - 1)]++;
+        });
+
+        // Начало диапазона (корзина b, поток t): все меньшие корзины всех
+        // потоков + корзина b у потоков до t.
+        std::size_t sum = 0;
+        bool trivial = false;
+        for (std::size_t b = 0; b < RADIX_BUCKETS; ++b) {
+            std::size_t bucket_total = 0;
+            for (unsigned t = 0; t < threads; ++t) {
+                std::size_t& c = hist[(std::size_t)t * RADIX_BUCKETS + b];
+                bucket_total += c;
+                const std::size_t cnt = c;
+                c = sum;
+                sum += cnt;
+            }
+            if (bucket_total == n) trivial = true;
+        }
+        if (trivial) continue;
+
+        radix_run_parallel(threads, [&](unsigned t) {
+            std::size_t* h = hist.data() + (std::size_t)t * RADIX_BUCKETS;
+            const std::size_t e = chunk_begin(t + 1);
+            for (std::size_t i = chunk_begin(t); i < e; ++i) {
+                const PackedPosting p = src[i];
+                dst[h[(p.hash >> shift) & (RADIX_BUCKETS - 1)]++] = p;
+            }
+        });
+        std::swap(src, dst);
+    }
+
+    if (src != v.data()) v.swap(tmp);
+}
+
+inline void radix_sort_postings(std::vector<PackedPosting>& v, unsigned threads = 1) {
+    std::vector<PackedPosting> tmp;
+    radix_sort_postings(v, tmp, threads);
+}
+
+// ---- Внешняя сортировка (--mem-budget) ----
+//
+// Builder сортирует заполненный буфер постингов и сбрасывает его прогоном
+// в файл (PackedPosting[] как есть), а в конце сливает прогоны и остаток в
+// памяти кучей по (hash, doc) прямо в выходной поток. Документы одного
+// прогона целиком в нём, поэтому слияние даёт тот же порядок, что и одна
+// сортировка всего массива.
+
+inline bool write_posting_run(const std::string& path, const std::vector<PackedPosting>& v, std::string& err) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) { err = "cannot open " + path + " for write"; return false; }
+    out.write((const char*)v.data(), (std::streamsize)(v.size() * sizeof(PackedPosting)));
+    if (!out) { err = "write failed: " + path; return false; }
+    return true;
+}
+
+// Источник слияния: файл прогона, читаемый окнами по buf_records, или
+// уже отсортированный массив в памяти (окно = весь массив).
+class PostingRunSource {
+public:
+    bool open_file(const std::string& path, std::size_t buf_records, std::string& err) {
+        in_.open(path, std::ios::binary);
+        if (!in_) { err = "cannot open " + path; return false; }
+        path_ = path;
+        buf_.resize(std::max<std::size_t>(1, buf_records));
+        return refill(err);
+    }
+
+    void open_memory(const std::vector<PackedPosting>& v) {
+        cur_ = v.data();
+        end_ = v.data() + v.size();
+    }
+
+    bool empty() const { return cur_ == end_; }
+    const PackedPosting& front() const { return *cur_; }
+
+    bool pop(std::string& err) {
+        ++cur_;
+        if (cur_ == end_ && in_.is_open()) return refill(err);
+        return true;
+    }
+
+private:
+    std::ifstream in_;
+    std::string path_;
+    std::vector<PackedPosting> buf_;
+    const PackedPosting* cur_ = nullptr;
+    const PackedPosting* end_ = nullptr;
+
+    bool refill(std::string& err) {
+        in_.read((char*)buf_.data(), (std::streamsize)(buf_.size() * sizeof(PackedPosting)));
+        const std::size_t got = (std::size_t)in_.gcount();
+        if (got % sizeof(PackedPosting) != 0) { err = "truncated run: " + path_; return false; }
+        if (in_.bad()) { err = "read failed: " + path_; return false; }
+        cur_ = buf_.data();
+        end_ = buf_.data() + got / sizeof(PackedPosting);
+        if (got == 0) in_.close();
+        return true;
+    }
+};
+
+// Слияние прогонов run_paths и mem_run: пачки слитых постингов уходят в
+// emit(const PackedPosting*, n) — запись сырой секции или сжатие.
+// buf_records — окно чтения на прогон и размер пачки. n_written — сколько
+// постингов выдано.
+template <class Emit>
+inline bool merge_posting_runs(
+    const std::vector<std::string>& run_paths,
+    const std::vector<PackedPosting>& mem_run,
+    std::size_t buf_records,
+    Emit&& emit,
+    std::uint64_t& n_written,
+    std::string& err
+) {
+    std::vector<PostingRunSource> src(run_paths.size() + 1);
+    for (std::size_t i = 0; i < run_paths.size(); ++i)
+        if (!src[i].open_file(run_paths[i], buf_records, err)) return false;
+    src.back().open_memory(mem_run);
+
+    // min-куча индексов источников; при равных постингах — меньший индекс
+    auto greater = [&](std::size_t a, std::size_t b) {
+        const PackedPosting& x = src[a].front();
+        const PackedPosting& y = src[b].front();
+        if (x.hash != y.hash) return x.hash > y.hash;
+        if (x.doc != y.doc)   return x.doc > y.doc;
+        return a > b;
+    };
+    std::vector<std::size_t> heap;
+    for (std::size_t i = 0; i < src.size(); ++i)
+        if (!src[i].empty()) heap.push_back(i);
+    std::make_heap(heap.begin(), heap.end(), greater);
+
+    std::vector<PackedPosting> obuf;
+    obuf.reserve(std::max<std::size_t>(1, buf_records));
+    auto flush = [&] {
+        emit(obuf.data(), obuf.size());
+        n_written += obuf.size();
+        obuf.clear();
+    };
+
+    n_written = 0;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        const std::size_t i = heap.back();
+        obuf.push_back(src[i].front());
+        if (obuf.size() == obuf.capacity()) flush();
+        if (!src[i].pop(err)) return false;
+        if (src[i].empty()) heap.pop_back();
+        else std::push_heap(heap.begin(), heap.end(), greater);
+    }
+    flush();
+    return true;
+}
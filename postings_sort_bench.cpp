@@ -0,0 +1,85 @@
+// Бенчмарк сортировки postings9: std::sort по std::pair<u64, u32> (как
+// было в index_builder) против radix_sort_postings по PackedPosting.
+//
+//   postings_sort_bench [n_postings=20000000] [threads=hardware_concurrency] [dup_pct=5]
+//
+// Вход повторяет builder: постинги идут по возрастанию doc, ~400 на
+// документ, dup_pct процентов хэшей — повторы из общего пула (общие шинглы).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "text_common.h"
+#include "postings_sort.h"
+
+namespace {
+
+double seconds_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+std::vector<PackedPosting> make_postings(std::size_t n, int dup_pct) {
+    std::vector<PackedPosting> v(n);
+    std::uint64_t rng = 0x9E3779B97F4A7C15ull;
+    const std::size_t pool = 4096;
+    for (std::size_t i = 0; i < n; ++i) {
+        rng = mix64(rng + i);
+        const bool dup = (int)(rng % 100) < dup_pct;
+        v[i].hash = dup ? mix64(rng % pool) : mix64(rng ^ 0xA5A5A5A5ull);
+        v[i].doc  = (std::uint32_t)(i / 400);
+    }
+    return v;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const std::size_t n   = argc > 1 ? (std::size_t)std::strtoull(argv[1], nullptr, 10) : 20000000;
+    const unsigned threads = argc > 2 ? (unsigned)std::atoi(argv[2])
+                                      : std::max(1u, std::thread::hardware_concurrency());
+    const int dup_pct     = argc > 3 ? std::atoi(argv[3]) : 5;
+
+    const std::vector<PackedPosting> input = make_postings(n, dup_pct);
+
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> pairs;
+    pairs.reserve(n);
+    for (const auto& p : input) pairs.emplace_back(p.hash, p.doc);
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::sort(pairs.begin(), pairs.end(),
+              [](const auto& a, const auto& b) {
+                  if (a.first < b.first) return true;
+                  if (a.first > b.first) return false;
+                  return a.second < b.second;
+              });
+    const double t_std = seconds_since(t0);
+
+    std::cout << "n=" << n << " pair_bytes=" << sizeof(pairs[0])
+              << " packed_bytes=" << sizeof(PackedPosting) << "\n";
+    std::cout << "std::sort pair          " << t_std << " s\n";
+
+    std::vector<PackedPosting> tmp;
+    for (unsigned t = 1; t <= threads; t = (t < threads && t * 2 > threads) ? threads : t * 2) {
+        std::vector<PackedPosting> v = input;
+        t0 = std::chrono::steady_clock::now();
+        radix_sort_postings(v, tmp, t);
+        const double t_radix = seconds_since(t0);
+
+        bool same = true;
+        for (std::size_t i = 0; i < n && same; ++i)
+            same = v[i].hash == pairs[i].first && v[i].doc == pairs[i].second;
+
+        std::cout << "radix packed threads=" << t << "  " << t_radix << " s"
+                  << "  speedup=" << (t_radix > 0 ? t_std / t_radix : 0.0)
+                  << (same ? "" : "  MISMATCH") << "\n";
+        if (!same) return 1;
+        if (t == threads) break;
+    }
+    return 0;
+}
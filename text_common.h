@@ -1,46 +1,254 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <utility>
+#include <type_traits>
 #include <cctype>
 #include <cstring>
+#include <algorithm>
 
 struct TokenSpan {
     std::uint32_t start = 0;
     std::uint32_t len   = 0;
 };
 
+// Результат записи в буфер вызывающего (API *_into): written — сколько
+// элементов записано, more — сколько ещё не влезло (0 -> всё записано).
+// Хватает одного повтора с ёмкостью written + more.
+struct FillResult {
+    std::size_t written = 0;
+    std::size_t more    = 0;
+
+    bool ok() const { return more == 0; }
+};
+
 // Нормализация (MVP):
 // - ASCII -> lower
 // - все ASCII не [a-z0-9] превращаем в пробел
 // - байты >=128 оставляем как есть (UTF-8 без lower, иначе нужен ICU)
-inline std::string normalize_for_shingles_simple(const std::string& s) {
-    std::string out;
-    out.reserve(s.size());
+//
+// Есть три ядра с побайтно одинаковым результатом: scalar, sse42 (16 байт
+// за шаг) и avx2 (32 байта за шаг). normalize_for_shingles_simple выбирает
+// ядро один раз по CPUID; индексы от выбора ядра не зависят.
+
+// Запас в выходном буфере: SIMD-ядра пишут по 8 байт, даже если реально
+// выдают меньше.
+constexpr std::size_t NORM_OUT_SLACK = 32;
+
+// Один байт скалярной нормализации; общий для хвостов SIMD-ядер.
+inline char* normalize_byte_scalar(unsigned char ch, char* o, bool& prev_space) {
+    if (ch < 128) {
+        unsigned char c = (unsigned char)std::tolower(ch);
+        bool ok = (std::isalnum(c) != 0);
+        if (ok) {
+            *o++ = (char)c;
+            prev_space = false;
+        } else {
+            if (!prev_space) *o++ = ' ';
+            prev_space = true;
+        }
+    } else {
+        *o++ = (char)ch;
+        prev_space = false;
+    }
+    return o;
+}
+
+// dst должен вмещать n + NORM_OUT_SLACK байт. Возвращает длину результата.
+inline std::size_t normalize_raw_scalar(const char* src, std::size_t n, char* dst) {
+    const unsigned char* p = (const unsigned char*)src;
+    char* o = dst;
     bool prev_space = true;
+    for (std::size_t i = 0; i < n; ++i) o = normalize_byte_scalar(p[i], o, prev_space);
+    while (o != dst && o[-1] == ' ') --o;
+    return (std::size_t)(o - dst);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define TEXT_COMMON_X86_SIMD 1
+#include <immintrin.h>
+
+// Таблица упаковки для pshufb: по 8-битной маске "какие байты оставить"
+// даёт индексы оставляемых байтов подряд и их количество.
+struct NormCompactTable {
+    std::uint8_t idx[256][16];
+    std::uint8_t cnt[256];
+};
 
-    for (unsigned char ch : s) {
-        if (ch < 128) {
-            unsigned char c = (unsigned char)std::tolower(ch);
-            bool ok = (std::isalnum(c) != 0);
-            if (ok) {
-                out.push_back((char)c);
-                prev_space = false;
-            } else {
-                if (!prev_space) out.push_back(' ');
-                prev_space = true;
+constexpr NormCompactTable make_norm_compact_table() {
+    NormCompactTable t{};
+    for (int m = 0; m < 256; ++m) {
+        int k = 0;
+        for (int b = 0; b < 8; ++b) {
+            if (m & (1 << b)) {
+                t.idx[m][k]     = (std::uint8_t)b;
+                t.idx[m][k + 8] = (std::uint8_t)(b + 8);
+                ++k;
             }
-        } else {
-            out.push_back((char)ch);
+        }
+        for (int r = k; r < 8; ++r) {
+            t.idx[m][r]     = 0x80;
+            t.idx[m][r + 8] = 0x80;
+        }
+        t.cnt[m] = (std::uint8_t)k;
+    }
+    return t;
+}
+
+inline constexpr NormCompactTable NORM_COMPACT = make_norm_compact_table();
+
+// Упаковывает 16 байт v по 16-битной маске emit в o; возвращает новый o.
+__attribute__((target("sse4.2")))
+inline char* norm_compact16(__m128i v, std::uint32_t emit, char* o) {
+    const std::uint32_t m0 = emit & 0xFFu;
+    const std::uint32_t m1 = (emit >> 8) & 0xFFu;
+
+    __m128i i0 = _mm_loadl_epi64((const __m128i*)NORM_COMPACT.idx[m0]);
+    __m128i i1 = _mm_loadl_epi64((const __m128i*)(NORM_COMPACT.idx[m1] + 8));
+    _mm_storel_epi64((__m128i*)o, _mm_shuffle_epi8(v, i0));
+    o += NORM_COMPACT.cnt[m0];
+    _mm_storel_epi64((__m128i*)o, _mm_shuffle_epi8(v, i1));
+    o += NORM_COMPACT.cnt[m1];
+    return o;
+}
+
+// keep: [a-z0-9] после lower или байт >=128; разделитель пишем только
+// первым в серии (carry = предыдущий байт был "keep").
+inline std::uint32_t norm_emit_mask(std::uint32_t keep, std::uint32_t carry) {
+    return keep | (~keep & ((keep << 1) | carry));
+}
+
+__attribute__((target("sse4.2")))
+inline std::size_t normalize_raw_sse42(const char* src, std::size_t n, char* dst) {
+    const __m128i A1   = _mm_set1_epi8('A' - 1);
+    const __m128i Z1   = _mm_set1_epi8('Z' + 1);
+    const __m128i a1   = _mm_set1_epi8('a' - 1);
+    const __m128i z1   = _mm_set1_epi8('z' + 1);
+    const __m128i d0   = _mm_set1_epi8('0' - 1);
+    const __m128i d9   = _mm_set1_epi8('9' + 1);
+    const __m128i bit5 = _mm_set1_epi8(0x20);
+    const __m128i sp   = _mm_set1_epi8(' ');
+    const __m128i zero = _mm_setzero_si128();
+
+    char* o = dst;
+    bool prev_space = true;
+    std::size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+
+        __m128i up = _mm_and_si128(_mm_cmpgt_epi8(v, A1), _mm_cmplt_epi8(v, Z1));
+        __m128i lo = _mm_or_si128(v, _mm_and_si128(up, bit5));
+        __m128i al = _mm_and_si128(_mm_cmpgt_epi8(lo, a1), _mm_cmplt_epi8(lo, z1));
+        __m128i dg = _mm_and_si128(_mm_cmpgt_epi8(v, d0), _mm_cmplt_epi8(v, d9));
+        __m128i hb = _mm_cmpgt_epi8(zero, v);
+        __m128i keepv = _mm_or_si128(_mm_or_si128(al, dg), hb);
+
+        const std::uint32_t keep = (std::uint32_t)_mm_movemask_epi8(keepv);
+        if (keep == 0xFFFFu) {
+            _mm_storeu_si128((__m128i*)o, lo);
+            o += 16;
             prev_space = false;
+            continue;
         }
+
+        const std::uint32_t emit = norm_emit_mask(keep, prev_space ? 0u : 1u) & 0xFFFFu;
+        __m128i out = _mm_blendv_epi8(sp, lo, keepv);
+        o = norm_compact16(out, emit, o);
+        prev_space = ((keep >> 15) & 1u) == 0;
     }
-    while (!out.empty() && out.back() == ' ') out.pop_back();
+
+    const unsigned char* p = (const unsigned char*)src;
+    for (; i < n; ++i) o = normalize_byte_scalar(p[i], o, prev_space);
+    while (o != dst && o[-1] == ' ') --o;
+    return (std::size_t)(o - dst);
+}
+
+__attribute__((target("avx2")))
+inline std::size_t normalize_raw_avx2(const char* src, std::size_t n, char* dst) {
+    const __m256i A1   = _mm256_set1_epi8('A' - 1);
+    const __m256i Z1   = _mm256_set1_epi8('Z' + 1);
+    const __m256i a1   = _mm256_set1_epi8('a' - 1);
+    const __m256i z1   = _mm256_set1_epi8('z' + 1);
+    const __m256i d0   = _mm256_set1_epi8('0' - 1);
+    const __m256i d9   = _mm256_set1_epi8('9' + 1);
+    const __m256i bit5 = _mm256_set1_epi8(0x20);
+    const __m256i sp   = _mm256_set1_epi8(' ');
+    const __m256i zero = _mm256_setzero_si256();
+
+    char* o = dst;
+    bool prev_space = true;
+    std::size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+
+        __m256i up = _mm256_and_si256(_mm256_cmpgt_epi8(v, A1), _mm256_cmpgt_epi8(Z1, v));
+        __m256i lo = _mm256_or_si256(v, _mm256_and_si256(up, bit5));
+        __m256i al = _mm256_and_si256(_mm256_cmpgt_epi8(lo, a1), _mm256_cmpgt_epi8(z1, lo));
+        __m256i dg = _mm256_and_si256(_mm256_cmpgt_epi8(v, d0), _mm256_cmpgt_epi8(d9, v));
+        __m256i hb = _mm256_cmpgt_epi8(zero, v);
+        __m256i keepv = _mm256_or_si256(_mm256_or_si256(al, dg), hb);
+
+        const std::uint32_t keep = (std::uint32_t)_mm256_movemask_epi8(keepv);
+        if (keep == 0xFFFFFFFFu) {
+            _mm256_storeu_si256((__m256i*)o, lo);
+            o += 32;
+            prev_space = false;
+            continue;
+        }
+
+        const std::uint32_t emit = norm_emit_mask(keep, prev_space ? 0u : 1u);
+        __m256i out = _mm256_blendv_epi8(sp, lo, keepv);
+        o = norm_compact16(_mm256_castsi256_si128(out), emit & 0xFFFFu, o);
+        o = norm_compact16(_mm256_extracti128_si256(out, 1), emit >> 16, o);
+        prev_space = (keep >> 31) == 0;
+    }
+
+    const unsigned char* p = (const unsigned char*)src;
+    for (; i < n; ++i) o = normalize_byte_scalar(p[i], o, prev_space);
+    while (o != dst && o[-1] == ' ') --o;
+    return (std::size_t)(o - dst);
+}
+#endif
+
+using NormalizeRawFn = std::size_t (*)(const char*, std::size_t, char*);
+
+struct NormalizeKernel {
+    NormalizeRawFn fn;
+    const char*    name;
+};
+
+// Выбор ядра по CPU, один раз на процесс.
+inline const NormalizeKernel& normalize_kernel() {
+    static const NormalizeKernel k = [] {
+#ifdef TEXT_COMMON_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))   return NormalizeKernel{normalize_raw_avx2, "avx2"};
+        if (__builtin_cpu_supports("sse4.2")) return NormalizeKernel{normalize_raw_sse42, "sse42"};
+#endif
+        return NormalizeKernel{normalize_raw_scalar, "scalar"};
+    }();
+    return k;
+}
+
+// Сколько байт нужно выходному буферу нормализации для n байт входа
+// (любой NormMode: свёртка UTF-8 результат не удлиняет).
+inline std::size_t normalize_capacity(std::size_t n) {
+    return n + NORM_OUT_SLACK;
+}
+
+inline std::string normalize_for_shingles_simple(std::string_view s) {
+    std::string out;
+    out.resize(s.size() + NORM_OUT_SLACK);
+    out.resize(normalize_kernel().fn(s.data(), s.size(), &out[0]));
     return out;
 }
 
-inline void tokenize_spans(const std::string& norm, std::vector<TokenSpan>& spans) {
+inline void tokenize_spans(std::string_view norm, std::vector<TokenSpan>& spans) {
     spans.clear();
     const std::uint32_t n = (std::uint32_t)norm.size();
     std::uint32_t i = 0;
@@ -76,8 +284,941 @@ inline std::uint64_t mix64(std::uint64_t x) {
     return x;
 }
 
+// ---- Семейство хэша токенов ----
+//
+// Fnv1a64 — исторический (один байт на умножение). Wy64 — wyhash-подобный:
+// байты копятся в 64-битное слово, умножение 64x64->128 раз на 8 байт.
+// Семейство записывается в заголовок индекса; запрос обязан хэшироваться
+// тем же семейством.
+enum class HashFamily : std::uint32_t {
+    Fnv1a64 = 0,
+    Wy64    = 1,
+};
+
+inline const char* hash_family_name(HashFamily f) {
+    return f == HashFamily::Wy64 ? "wy64" : "fnv1a64";
+}
+
+inline bool parse_hash_family(std::string_view s, HashFamily& f) {
+    if (s == "fnv1a64" || s == "fnv") { f = HashFamily::Fnv1a64; return true; }
+    if (s == "wy64")                  { f = HashFamily::Wy64;    return true; }
+    return false;
+}
+
+constexpr std::uint64_t WY64_P0 = 0xa0761d6478bd642full;
+constexpr std::uint64_t WY64_P1 = 0xe7037ed1a0b428dbull;
+constexpr std::uint64_t WY64_P2 = 0x8ebc6af09c88c6e3ull;
+constexpr std::uint64_t WY64_P3 = 0x589965cc75374cc3ull;
+
+inline std::uint64_t wymix64(std::uint64_t a, std::uint64_t b) {
+    const __uint128_t r = (__uint128_t)a * b;
+    return (std::uint64_t)r ^ (std::uint64_t)(r >> 64);
+}
+
+// Потоковый Wy64: байты приходят по одному (после нормализации), слово
+// сворачивается каждые 8 байт. Совпадает с tokhash_wy64 на тех же байтах.
+struct Wy64Stream {
+    std::uint64_t h = WY64_P0;
+    std::uint64_t w = 0;
+    std::uint32_t k = 0;
+    std::uint64_t len = 0;
+
+    void begin() { h = WY64_P0; w = 0; k = 0; len = 0; }
+
+    void push(unsigned char c) {
+        w |= (std::uint64_t)c << (8 * k);
+        if (++k == 8) {
+            h = wymix64(w ^ WY64_P1, h ^ WY64_P2);
+            w = 0;
+            k = 0;
+        }
+        ++len;
+    }
+
+    std::uint64_t finish() const {
+        return wymix64(wymix64(w ^ WY64_P1, h ^ WY64_P2 ^ len), WY64_P3);
+    }
+
+    // Ascii-режим: токен с позиции i сырого буфера p[0..n); i сдвигается
+    // за конец токена. Сначала ищется конец, затем байты сворачиваются
+    // словами по 8 с SWAR lower для A-Z.
+    static std::uint64_t hash_ascii_token(const unsigned char* p, std::size_t n, std::size_t& i);
+};
+
+struct Fnv1a64Stream {
+    std::uint64_t h = 1469598103934665603ull;
+
+    void begin() { h = 1469598103934665603ull; }
+
+    void push(unsigned char c) {
+        h ^= (std::uint64_t)c;
+        h *= 1099511628211ull;
+    }
+
+    std::uint64_t finish() const { return h; }
+
+    static std::uint64_t hash_ascii_token(const unsigned char* p, std::size_t n, std::size_t& i);
+};
+
+inline std::uint64_t tokhash_wy64(const void* data, std::size_t n) {
+    const unsigned char* p = (const unsigned char*)data;
+    std::uint64_t h = WY64_P0;
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h = wymix64(w ^ WY64_P1, h ^ WY64_P2);
+    }
+    std::uint64_t t = 0;
+    for (std::size_t k = 0; i < n; ++i, ++k) t |= (std::uint64_t)p[i] << (8 * k);
+    return wymix64(wymix64(t ^ WY64_P1, h ^ WY64_P2 ^ (std::uint64_t)n), WY64_P3);
+}
+
+// SWAR lower для 8 байт: только байты 'A'..'Z' получают бит 0x20.
+// Сложения идут по байтам <= 0x7F, переносов между байтами нет.
+inline std::uint64_t swar_ascii_lower(std::uint64_t x) {
+    constexpr std::uint64_t ONES = 0x0101010101010101ull;
+    constexpr std::uint64_t HIGH = 0x8080808080808080ull;
+    const std::uint64_t t  = x & ~HIGH;
+    const std::uint64_t ge = t + ONES * (0x80 - 'A');       // t >= 'A'
+    const std::uint64_t gt = t + ONES * (0x80 - 'Z' - 1);   // t >  'Z'
+    const std::uint64_t up = ge & ~gt & ~x & HIGH;
+    return x | (up >> 2);
+}
+
+inline std::uint64_t wy64_ascii_lower_run(const unsigned char* p, std::size_t len, std::size_t avail) {
+    std::uint64_t h = WY64_P0;
+    std::size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h = wymix64(swar_ascii_lower(w) ^ WY64_P1, h ^ WY64_P2);
+    }
+    std::uint64_t t = 0;
+    const std::size_t r = len - i;
+    if (r) {
+        if (i + 8 <= avail) {
+            // хвост одним чтением в пределах буфера, лишние байты маскируем
+            std::memcpy(&t, p + i, 8);
+            t &= ~0ull >> (64 - 8 * r);
+        } else {
+            for (std::size_t k = 0; k < r; ++k) t |= (std::uint64_t)p[i + k] << (8 * k);
+        }
+        t = swar_ascii_lower(t);
+    }
+    return wymix64(wymix64(t ^ WY64_P1, h ^ WY64_P2 ^ (std::uint64_t)len), WY64_P3);
+}
+
+// Хэш одного нормализованного токена в заданном семействе (путь запроса).
+inline std::uint64_t token_hash(const void* data, std::size_t n, HashFamily f) {
+    return f == HashFamily::Wy64 ? tokhash_wy64(data, n) : fnv1a64(data, n);
+}
+
+// Класс байта для нормализации: lower-байт токена или 0 для разделителя.
+// Те же правила, что у normalize_byte_scalar (C-локаль, байты >=128 как есть).
+struct NormByteMap {
+    unsigned char map[256];
+};
+
+constexpr NormByteMap make_norm_byte_map() {
+    NormByteMap t{};
+    for (int c = 0; c < 256; ++c) {
+        unsigned char m = 0;
+        if (c >= 'A' && c <= 'Z')      m = (unsigned char)(c + 32);
+        else if (c >= 'a' && c <= 'z') m = (unsigned char)c;
+        else if (c >= '0' && c <= '9') m = (unsigned char)c;
+        else if (c >= 128)             m = (unsigned char)c;
+        t.map[c] = m;
+    }
+    return t;
+}
+
+inline constexpr NormByteMap NORM_BYTE_MAP = make_norm_byte_map();
+
+inline std::uint64_t Fnv1a64Stream::hash_ascii_token(const unsigned char* p, std::size_t n, std::size_t& i) {
+    std::uint64_t h = 1469598103934665603ull;
+    unsigned char c;
+    while (i < n && (c = NORM_BYTE_MAP.map[p[i]]) != 0) {
+        h ^= (std::uint64_t)c;
+        h *= 1099511628211ull;
+        i++;
+    }
+    return h;
+}
+
+inline std::uint64_t Wy64Stream::hash_ascii_token(const unsigned char* p, std::size_t n, std::size_t& i) {
+    const std::size_t start = i;
+    while (i < n && NORM_BYTE_MAP.map[p[i]] != 0) i++;
+    return wy64_ascii_lower_run(p + start, i - start, n - start);
+}
+
+// ---- UTF-8 свёртка регистра (без ICU) ----
+//
+// NormMode::Utf8Fold: ASCII как в normalize_for_shingles_simple, плюс
+// - простая свёртка регистра для Latin-1, Latin Extended-A/B (регулярные
+//   пары), греческого, кириллицы (включая дополнение) и армянского;
+// - пунктуация Latin-1 и General Punctuation (U+2000..U+206F), «», —, …
+//   и т.п. становятся разделителями;
+// - невидимые символы (мягкий перенос, ZWSP/ZWJ, BOM) выбрасываются без
+//   разрыва токена;
+// - остальное (в т.ч. невалидные байты) копируется как есть.
+// Режим записывается в заголовок индекса: старые индексы (Ascii) остаются
+// воспроизводимыми.
+enum class NormMode : std::uint32_t {
+    Ascii    = 0,
+    Utf8Fold = 1,
+};
+
+inline const char* norm_mode_name(NormMode m) {
+    return m == NormMode::Utf8Fold ? "utf8" : "ascii";
+}
+
+inline bool parse_norm_mode(std::string_view s, NormMode& m) {
+    if (s == "ascii") { m = NormMode::Ascii;    return true; }
+    if (s == "utf8")  { m = NormMode::Utf8Fold; return true; }
+    return false;
+}
+
+// Всё, что определяет хэши токенов: должно совпадать у индекса и запроса.
+struct TextParams {
+    NormMode   norm = NormMode::Ascii;
+    HashFamily hash = HashFamily::Fnv1a64;
+};
+
+constexpr std::uint16_t UTF8_FOLD_SEP    = 0;
+constexpr std::uint16_t UTF8_FOLD_IGNORE = 0xFFFF;
+
+// Таблица для двухбайтовых последовательностей U+0080..U+07FF:
+// свёрнутый код, UTF8_FOLD_SEP или UTF8_FOLD_IGNORE. 3.75 КБ.
+struct Utf8Fold2Table {
+    std::uint16_t cp[0x800 - 0x80];
+};
+
+constexpr std::uint16_t utf8_fold2_rule(std::uint32_t c) {
+    // Latin-1: пунктуация/символы, кроме ª µ º
+    if (c == 0xAD) return UTF8_FOLD_IGNORE;
+    if (c < 0xC0) return (c == 0xAA || c == 0xB5 || c == 0xBA) ? (std::uint16_t)c : UTF8_FOLD_SEP;
+    if (c == 0xD7 || c == 0xF7) return UTF8_FOLD_SEP;
+    if (c >= 0xC0 && c <= 0xDE) return (std::uint16_t)(c + 0x20);
+
+    // Latin Extended-A
+    if (c == 0x130) return 0x69;                 // İ -> i
+    if (c == 0x178) return 0xFF;                 // Ÿ -> ÿ
+    if (c == 0x17F) return 0x73;                 // ſ -> s
+    if ((c >= 0x100 && c <= 0x12F) || (c >= 0x132 && c <= 0x137) ||
+        (c >= 0x14A && c <= 0x177))
+        return (std::uint16_t)((c & 1) ? c : c + 1);
+    if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+        return (std::uint16_t)((c & 1) ? c + 1 : c);
+
+    // Latin Extended-B: только регулярные пары
+    if (c >= 0x1CD && c <= 0x1DC) return (std::uint16_t)((c & 1) ? c + 1 : c);
+    if ((c >= 0x1DE && c <= 0x1EF) || (c >= 0x1F8 && c <= 0x21F) ||
+        (c >= 0x222 && c <= 0x233) || (c >= 0x246 && c <= 0x24F))
+        return (std::uint16_t)((c & 1) ? c : c + 1);
+
+    // Греческий
+    if (c == 0x37E || c == 0x387) return UTF8_FOLD_SEP;
+    if (c == 0x386) return 0x3AC;
+    if (c >= 0x388 && c <= 0x38A) return (std::uint16_t)(c + 0x25);
+    if (c == 0x38C) return 0x3CC;
+    if (c == 0x38E || c == 0x38F) return (std::uint16_t)(c + 0x3F);
+    if ((c >= 0x391 && c <= 0x3A1) || (c >= 0x3A3 && c <= 0x3AB)) return (std::uint16_t)(c + 0x20);
+    if (c == 0x3C2) return 0x3C3;                // ς -> σ
+
+    // Кириллица
+    if (c >= 0x400 && c <= 0x40F) return (std::uint16_t)(c + 0x50);
+    if (c >= 0x410 && c <= 0x42F) return (std::uint16_t)(c + 0x20);
+    if (c == 0x482) return UTF8_FOLD_SEP;        // ҂
+    if ((c >= 0x460 && c <= 0x481) || (c >= 0x48A && c <= 0x4BF) ||
+        (c >= 0x4D0 && c <= 0x52F))
+        return (std::uint16_t)((c & 1) ? c : c + 1);
+    if (c == 0x4C0) return 0x4CF;
+    if (c >= 0x4C1 && c <= 0x4CE) return (std::uint16_t)((c & 1) ? c + 1 : c);
+
+    // Армянский
+    if (c >= 0x531 && c <= 0x556) return (std::uint16_t)(c + 0x30);
+    if ((c >= 0x55A && c <= 0x55F) || c == 0x589) return UTF8_FOLD_SEP;
+
+    return (std::uint16_t)c;
+}
+
+constexpr Utf8Fold2Table make_utf8_fold2_table() {
+    Utf8Fold2Table t{};
+    for (std::uint32_t c = 0x80; c < 0x800; ++c) t.cp[c - 0x80] = utf8_fold2_rule(c);
+    return t;
+}
+
+inline constexpr Utf8Fold2Table UTF8_FOLD2 = make_utf8_fold2_table();
+
+// Трёхбайтовые: только классификация пунктуации, регистр не трогаем.
+inline std::uint16_t utf8_fold3_class(std::uint32_t c) {
+    if ((c >= 0x200B && c <= 0x200D) || (c >= 0x2060 && c <= 0x2064) || c == 0xFEFF)
+        return UTF8_FOLD_IGNORE;
+    if ((c >= 0x2000 && c <= 0x206F) || (c >= 0x2E00 && c <= 0x2E7F) ||
+        (c >= 0x3000 && c <= 0x3003) || (c >= 0x3008 && c <= 0x3011))
+        return UTF8_FOLD_SEP;
+    return 1; // буква/прочее: копировать как есть
+}
+
+// Один символ UTF-8. Возвращает число съеденных байт входа (>= 1).
+// out/out_len — байты токена (0 байт -> разделитель или невидимый),
+// sep — это разделитель.
+inline std::size_t fold_utf8_char(
+    const unsigned char* p,
+    std::size_t avail,
+    unsigned char out[4],
+    std::size_t& out_len,
+    bool& sep
+) {
+    const unsigned char b0 = p[0];
+    sep = false;
+
+    if (b0 < 0x80) {
+        const unsigned char m = NORM_BYTE_MAP.map[b0];
+        out[0] = m;
+        out_len = m ? 1 : 0;
+        sep = (m == 0);
+        return 1;
+    }
+
+    // 2 байта: прямой индекс в таблицу
+    if (b0 >= 0xC2 && b0 <= 0xDF && avail >= 2 && (p[1] & 0xC0) == 0x80) {
+        const std::uint32_t c = ((std::uint32_t)(b0 & 0x1F) << 6) | (p[1] & 0x3F);
+        const std::uint16_t f = UTF8_FOLD2.cp[c - 0x80];
+        if (f == UTF8_FOLD_SEP)    { out_len = 0; sep = true; return 2; }
+        if (f == UTF8_FOLD_IGNORE) { out_len = 0; return 2; }
+        if (f < 0x80) {
+            out[0] = (unsigned char)f;
+            out_len = 1;
+        } else {
+            out[0] = (unsigned char)(0xC0 | (f >> 6));
+            out[1] = (unsigned char)(0x80 | (f & 0x3F));
+            out_len = 2;
+        }
+        return 2;
+    }
+
+    if (b0 >= 0xE0 && b0 <= 0xEF && avail >= 3 &&
+        (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+        const std::uint32_t c = ((std::uint32_t)(b0 & 0x0F) << 12) |
+                                ((std::uint32_t)(p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+        const std::uint16_t k = utf8_fold3_class(c);
+        if (k == UTF8_FOLD_SEP)    { out_len = 0; sep = true; return 3; }
+        if (k == UTF8_FOLD_IGNORE) { out_len = 0; return 3; }
+        out[0] = p[0]; out[1] = p[1]; out[2] = p[2];
+        out_len = 3;
+        return 3;
+    }
+
+    if (b0 >= 0xF0 && b0 <= 0xF4 && avail >= 4 &&
+        (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80 && (p[3] & 0xC0) == 0x80) {
+        out[0] = p[0]; out[1] = p[1]; out[2] = p[2]; out[3] = p[3];
+        out_len = 4;
+        return 4;
+    }
+
+    // невалидный байт: как в Ascii-режиме, копируем
+    out[0] = b0;
+    out_len = 1;
+    return 1;
+}
+
+// dst должен вмещать normalize_capacity(n) байт. Возвращает длину.
+inline std::size_t normalize_raw_utf8(const char* src, std::size_t n, char* dst) {
+    const unsigned char* p = (const unsigned char*)src;
+    char* o = dst;
+    bool prev_space = true;
+    std::size_t i = 0;
+    unsigned char buf[4];
+    std::size_t len;
+    bool sep;
+
+    while (i < n) {
+        // ASCII fast path без декодирования
+        if (p[i] < 0x80) {
+            const unsigned char m = NORM_BYTE_MAP.map[p[i++]];
+            if (m) { *o++ = (char)m; prev_space = false; }
+            else if (!prev_space) { *o++ = ' '; prev_space = true; }
+            continue;
+        }
+        i += fold_utf8_char(p + i, n - i, buf, len, sep);
+        if (len) {
+            std::memcpy(o, buf, len);
+            o += len;
+            prev_space = false;
+        } else if (sep && !prev_space) {
+            *o++ = ' ';
+            prev_space = true;
+        }
+    }
+    while (o != dst && o[-1] == ' ') --o;
+    return (std::size_t)(o - dst);
+}
+
+inline std::string normalize_for_shingles_utf8(std::string_view s) {
+    std::string out;
+    out.resize(normalize_capacity(s.size()));
+    out.resize(normalize_raw_utf8(s.data(), s.size(), &out[0]));
+    return out;
+}
+
+inline std::string normalize_for_shingles(std::string_view s, NormMode mode) {
+    return mode == NormMode::Utf8Fold ? normalize_for_shingles_utf8(s)
+                                      : normalize_for_shingles_simple(s);
+}
+
+// Нормализация в буфер вызывающего, без аллокаций. Если cap меньше
+// normalize_capacity(s.size()), ничего не пишет и возвращает недостачу.
+inline FillResult normalize_for_shingles_into(
+    std::string_view s,
+    char* dst,
+    std::size_t cap,
+    NormMode mode = NormMode::Ascii
+) {
+    const std::size_t need = normalize_capacity(s.size());
+    if (cap < need) return FillResult{0, need - cap};
+    const std::size_t n = (mode == NormMode::Utf8Fold)
+        ? normalize_raw_utf8(s.data(), s.size(), dst)
+        : normalize_kernel().fn(s.data(), s.size(), dst);
+    return FillResult{n, 0};
+}
+
+// Приёмники токенов для проходов hash_tokens_*: в вектора (растут) или в
+// буферы фиксированной ёмкости (лишние токены только считаются).
+struct TokenVecSink {
+    std::vector<std::uint64_t>& hashes;
+    std::vector<TokenSpan>*     spans;
+    std::size_t                 count = 0;
+
+    void emit(std::uint64_t h, std::size_t start, std::size_t len) {
+        hashes.push_back(h);
+        if (spans) spans->push_back(TokenSpan{(std::uint32_t)start, (std::uint32_t)len});
+        ++count;
+    }
+};
+
+struct TokenBufSink {
+    std::uint64_t* hashes;
+    TokenSpan*     spans;
+    std::size_t    cap;
+    std::size_t    count = 0;
+
+    void emit(std::uint64_t h, std::size_t start, std::size_t len) {
+        if (count < cap) {
+            hashes[count] = h;
+            if (spans) spans[count] = TokenSpan{(std::uint32_t)start, (std::uint32_t)len};
+        }
+        ++count;
+    }
+};
+
+// Utf8Fold-проход. spans указывают на сырой текст и включают выброшенные
+// невидимые символы внутри токена.
+template <class HashStream, class Sink>
+inline void scan_tokens_utf8(const char* src, std::size_t n, std::size_t limit, Sink& sink) {
+    const unsigned char* p = (const unsigned char*)src;
+    std::size_t i = 0;
+    std::size_t start = 0;
+    std::size_t last_end = 0;
+    bool in_tok = false;
+    HashStream hs;
+    unsigned char buf[4];
+    std::size_t len;
+    bool sep;
+
+    while (i < n) {
+        const std::size_t at = i;
+        if (p[i] < 0x80) {
+            const unsigned char m = NORM_BYTE_MAP.map[p[i++]];
+            buf[0] = m; len = m ? 1 : 0; sep = (m == 0);
+        } else {
+            i += fold_utf8_char(p + i, n - i, buf, len, sep);
+        }
+
+        if (len) {
+            if (!in_tok) {
+                if (sink.count >= limit) return;
+                in_tok = true;
+                start = at;
+                hs.begin();
+            }
+            for (std::size_t k = 0; k < len; ++k) hs.push(buf[k]);
+            last_end = i;
+        } else if (sep && in_tok) {
+            sink.emit(hs.finish(), start, last_end - start);
+            in_tok = false;
+        }
+    }
+    if (in_tok) sink.emit(hs.finish(), start, last_end - start);
+}
+
+// Нормализация + токенизация + хэш токенов за один проход по сырому
+// тексту, без промежуточной нормализованной строки.
+template <class HashStream, class Sink>
+inline void scan_tokens_ascii(const char* src, std::size_t n, std::size_t limit, Sink& sink) {
+    const unsigned char* p = (const unsigned char*)src;
+    std::size_t i = 0;
+    while (i < n && sink.count < limit) {
+        while (i < n && NORM_BYTE_MAP.map[p[i]] == 0) i++;
+        if (i >= n) break;
+
+        const std::size_t start = i;
+        const std::uint64_t h = HashStream::hash_ascii_token(p, n, i);
+        sink.emit(h, start, i - start);
+    }
+}
+
+template <class Sink>
+inline void scan_tokens(const char* src, std::size_t n, std::size_t max_tokens,
+                        const TextParams& tp, Sink& sink) {
+    const std::size_t limit = max_tokens ? max_tokens : (std::size_t)-1;
+    const bool wy = (tp.hash == HashFamily::Wy64);
+    if (tp.norm == NormMode::Utf8Fold) {
+        if (wy) scan_tokens_utf8<Wy64Stream>(src, n, limit, sink);
+        else    scan_tokens_utf8<Fnv1a64Stream>(src, n, limit, sink);
+    } else {
+        if (wy) scan_tokens_ascii<Wy64Stream>(src, n, limit, sink);
+        else    scan_tokens_ascii<Fnv1a64Stream>(src, n, limit, sink);
+    }
+}
+
+// hashes[i] == token_hash(токен i нормализованного текста, tp.hash),
+// spans (если заданы) указывают на токены в СЫРОМ тексте. Буферы
+// переиспользуются вызывающим. max_tokens = 0 -> без лимита.
+// Возвращает число токенов.
+inline std::size_t hash_tokens_fused(
+    const char* src,
+    std::size_t n,
+    std::vector<std::uint64_t>& hashes,
+    std::vector<TokenSpan>* spans = nullptr,
+    std::size_t max_tokens = 0,
+    const TextParams& tp = TextParams{}
+) {
+    hashes.clear();
+    if (spans) spans->clear();
+    TokenVecSink sink{hashes, spans};
+    scan_tokens(src, n, max_tokens, tp, sink);
+    return sink.count;
+}
+
+inline std::size_t hash_tokens_fused(
+    std::string_view s,
+    std::vector<std::uint64_t>& hashes,
+    std::vector<TokenSpan>* spans = nullptr,
+    std::size_t max_tokens = 0,
+    const TextParams& tp = TextParams{}
+) {
+    return hash_tokens_fused(s.data(), s.size(), hashes, spans, max_tokens, tp);
+}
+
+// То же в буферы вызывающего ёмкостью cap (spans может быть nullptr).
+// Без аллокаций; при нехватке more = сколько токенов не влезло.
+inline FillResult hash_tokens_into(
+    std::string_view s,
+    std::uint64_t* hashes,
+    TokenSpan* spans,
+    std::size_t cap,
+    std::size_t max_tokens = 0,
+    const TextParams& tp = TextParams{}
+) {
+    TokenBufSink sink{hashes, spans, cap};
+    scan_tokens(s.data(), s.size(), max_tokens, tp, sink);
+    return sink.count <= cap ? FillResult{sink.count, 0} : FillResult{cap, sink.count - cap};
+}
+
+// Шинглы по всему документу из хэшей токенов: каждый токен хэшируется
+// один раз (hash_tokens_fused), окно сворачивается только целочисленно.
+// Свёртка FNV не обратима, поэтому "вычесть" выходящий токен нельзя: на
+// позицию остаётся K шагов умножения, но без чтения байтов.
+//
+// Две ширины K1 <= K2 считаются за один проход: шингл K2 на позиции pos —
+// это продолжение свёртки шингла K1 на той же позиции.
+// out1 получает min(max_pos, shingle_count(n, K1)) значений, out2 (если
+// задан) — min(max_pos, shingle_count(n, K2)). max_pos = 0 -> без лимита.
+
+inline std::size_t shingle_count(std::size_t n_tok, int K) {
+    return (K > 0 && n_tok >= (std::size_t)K) ? n_tok - (std::size_t)K + 1 : 0;
+}
+
+inline std::uint64_t shingle_fold(std::uint64_t h, std::uint64_t th) {
+    h ^= th; h *= 1099511628211ull;
+    h ^= 0x0Au; h *= 1099511628211ull; // '\n'
+    return h;
+}
+
+// Один шингл по готовым хэшам токенов th[0..K-1]; совпадает с
+// hash_shingle_tokens_spans.
+inline std::uint64_t hash_shingle_token_hashes(const std::uint64_t* th, int K) {
+    std::uint64_t h = 1469598103934665603ull;
+    for (int i = 0; i < K; ++i) h = shingle_fold(h, th[i]);
+    return h;
+}
+
+inline std::size_t hash_shingles_scalar(
+    const std::uint64_t* th,
+    std::size_t n_tok,
+    std::size_t max_pos,
+    int K1, std::uint64_t* out1,
+    int K2 = 0, std::uint64_t* out2 = nullptr
+) {
+    std::size_t c1 = shingle_count(n_tok, K1);
+    std::size_t c2 = out2 ? shingle_count(n_tok, K2) : 0;
+    if (max_pos) { c1 = std::min(c1, max_pos); c2 = std::min(c2, max_pos); }
+
+    const std::size_t cmax = std::max(c1, c2);
+    for (std::size_t pos = 0; pos < cmax; ++pos) {
+        std::uint64_t h = 1469598103934665603ull;
+        int i = 0;
+        if (pos < c1) {
+            for (; i < K1; ++i) h = shingle_fold(h, th[pos + i]);
+            out1[pos] = h;
+        }
+        if (pos < c2) {
+            for (; i < K2; ++i) h = shingle_fold(h, th[pos + i]);
+            out2[pos] = h;
+        }
+    }
+    return c1;
+}
+
+// То же, что hash_shingles_scalar, но 4 позиции сворачиваются параллельно:
+// цепочки умножений независимы, и CPU перекрывает их задержку.
+inline std::size_t hash_shingles_batch(
+    const std::uint64_t* th,
+    std::size_t n_tok,
+    std::size_t max_pos,
+    int K1, std::uint64_t* out1,
+    int K2 = 0, std::uint64_t* out2 = nullptr
+) {
+    std::size_t c1 = shingle_count(n_tok, K1);
+    std::size_t c2 = out2 ? shingle_count(n_tok, K2) : 0;
+    if (max_pos) { c1 = std::min(c1, max_pos); c2 = std::min(c2, max_pos); }
+
+    // блок из 4 позиций, где обе ширины валидны (или K2 не нужен)
+    const std::size_t cboth = out2 ? std::min(c1, c2) : c1;
+    std::size_t pos = 0;
+    for (; pos + 4 <= cboth; pos += 4) {
+        const std::uint64_t* t = th + pos;
+        std::uint64_t h0 = 1469598103934665603ull, h1 = h0, h2 = h0, h3 = h0;
+        int i = 0;
+        for (; i < K1; ++i) {
+            h0 = shingle_fold(h0, t[i]);
+            h1 = shingle_fold(h1, t[i + 1]);
+            h2 = shingle_fold(h2, t[i + 2]);
+            h3 = shingle_fold(h3, t[i + 3]);
+        }
+        out1[pos] = h0; out1[pos + 1] = h1; out1[pos + 2] = h2; out1[pos + 3] = h3;
+        if (out2) {
+            for (; i < K2; ++i) {
+                h0 = shingle_fold(h0, t[i]);
+                h1 = shingle_fold(h1, t[i + 1]);
+                h2 = shingle_fold(h2, t[i + 2]);
+                h3 = shingle_fold(h3, t[i + 3]);
+            }
+            out2[pos] = h0; out2[pos + 1] = h1; out2[pos + 2] = h2; out2[pos + 3] = h3;
+        }
+    }
+
+    const std::size_t cmax = std::max(c1, c2);
+    for (; pos < cmax; ++pos) {
+        std::uint64_t h = 1469598103934665603ull;
+        int i = 0;
+        if (pos < c1) {
+            for (; i < K1; ++i) h = shingle_fold(h, th[pos + i]);
+            out1[pos] = h;
+        }
+        if (pos < c2) {
+            for (; i < K2; ++i) h = shingle_fold(h, th[pos + i]);
+            out2[pos] = h;
+        }
+    }
+    return c1;
+}
+
+// ---- Шинглы с K времени компиляции ----
+//
+// hash_shingles_k<K1, K2> — то же, что hash_shingles_batch, но свёртка
+// окна полностью развёрнута. hash_shingles() выбирает инстанс по (K1, K2)
+// один раз на документ; для прочих K остаётся hash_shingles_batch.
+
+template <std::size_t... I>
+inline std::uint64_t shingle_fold_unrolled(std::uint64_t h, const std::uint64_t* t, std::index_sequence<I...>) {
+    ((h = shingle_fold(h, t[I])), ...);
+    return h;
+}
+
+// 4 соседние позиции сразу: t[I..I+3] — токен I каждого из 4 окон.
+template <std::size_t... I>
+inline void shingle_fold4_unrolled(std::uint64_t h[4], const std::uint64_t* t, std::index_sequence<I...>) {
+    ((h[0] = shingle_fold(h[0], t[I]),
+      h[1] = shingle_fold(h[1], t[I + 1]),
+      h[2] = shingle_fold(h[2], t[I + 2]),
+      h[3] = shingle_fold(h[3], t[I + 3])), ...);
+}
+
+template <int K1, int K2 = 0>
+inline std::size_t hash_shingles_k(
+    const std::uint64_t* th,
+    std::size_t n_tok,
+    std::size_t max_pos,
+    std::uint64_t* out1,
+    std::uint64_t* out2 = nullptr
+) {
+    static_assert(K1 > 0 && (K2 == 0 || K2 > K1), "need 0 < K1 < K2");
+    using Seq1 = std::make_index_sequence<(std::size_t)K1>;
+    using Seq2 = std::make_index_sequence<(std::size_t)(K2 > K1 ? K2 - K1 : 0)>;
+
+    std::size_t c1 = shingle_count(n_tok, K1);
+    std::size_t c2 = (K2 && out2) ? shingle_count(n_tok, K2) : 0;
+    if (max_pos) { c1 = std::min(c1, max_pos); c2 = std::min(c2, max_pos); }
+
+    // c2 <= c1: сначала позиции, где нужны обе ширины
+    const std::size_t cboth = (K2 && out2) ? c2 : c1;
+    std::size_t pos = 0;
+    for (; pos + 4 <= cboth; pos += 4) {
+        std::uint64_t h[4] = {1469598103934665603ull, 1469598103934665603ull,
+                              1469598103934665603ull, 1469598103934665603ull};
+        shingle_fold4_unrolled(h, th + pos, Seq1{});
+        std::memcpy(out1 + pos, h, sizeof(h));
+        if constexpr (K2 > 0) {
+            shingle_fold4_unrolled(h, th + pos + K1, Seq2{});
+            std::memcpy(out2 + pos, h, sizeof(h));
+        }
+    }
+    for (; pos < c1; ++pos) {
+        const std::uint64_t h = shingle_fold_unrolled(1469598103934665603ull, th + pos, Seq1{});
+        out1[pos] = h;
+        if constexpr (K2 > 0) {
+            if (pos < c2) out2[pos] = shingle_fold_unrolled(h, th + pos + K1, Seq2{});
+        }
+    }
+    return c1;
+}
+
+using ShingleKernel = std::size_t (*)(const std::uint64_t*, std::size_t, std::size_t,
+                                      std::uint64_t*, std::uint64_t*);
+
+// Инстансы для ширин, которые реально используются (9 — основная, 13 —
+// N_post13). Для остальных nullptr.
+inline ShingleKernel shingle_kernel(int K1, int K2) {
+    if (K1 == 9  && K2 == 0)  return hash_shingles_k<9>;
+    if (K1 == 13 && K2 == 0)  return hash_shingles_k<13>;
+    if (K1 == 9  && K2 == 13) return hash_shingles_k<9, 13>;
+    return nullptr;
+}
+
+inline std::size_t hash_shingles(
+    const std::uint64_t* th,
+    std::size_t n_tok,
+    std::size_t max_pos,
+    int K1, std::uint64_t* out1,
+    int K2 = 0, std::uint64_t* out2 = nullptr
+) {
+    if (!out2) K2 = 0;
+    if (ShingleKernel k = shingle_kernel(K1, K2)) return k(th, n_tok, max_pos, out1, out2);
+    return hash_shingles_batch(th, n_tok, max_pos, K1, out1, K2, out2);
+}
+
+// Шинглы по id токенов (словарь, IndexParams.token_ids = 1): пары id
+// склеиваются в одно 64-битное слово, на K=9 это 5 умножений 64x64->128
+// вместо 18 последовательных FNV-шагов. Значения отличаются от шинглов по
+// хэшам токенов, поэтому режим записывается в заголовок индекса.
+inline std::uint64_t hash_shingle_ids(const std::uint32_t* ids, int K) {
+    std::uint64_t h = WY64_P0 ^ (std::uint64_t)K;
+    int i = 0;
+    for (; i + 2 <= K; i += 2) {
+        const std::uint64_t w = (std::uint64_t)ids[i] | ((std::uint64_t)ids[i + 1] << 32);
+        h = wymix64(w ^ WY64_P1, h ^ WY64_P2);
+    }
+    if (i < K) h = wymix64((std::uint64_t)ids[i] ^ WY64_P1, h ^ WY64_P2);
+    return wymix64(h, WY64_P3);
+}
+
+template <int K>
+inline std::uint64_t hash_shingle_ids_k(const std::uint32_t* ids) {
+    std::uint64_t h = WY64_P0 ^ (std::uint64_t)K;
+    for (int i = 0; i + 2 <= K; i += 2) {
+        const std::uint64_t w = (std::uint64_t)ids[i] | ((std::uint64_t)ids[i + 1] << 32);
+        h = wymix64(w ^ WY64_P1, h ^ WY64_P2);
+    }
+    if constexpr (K % 2) h = wymix64((std::uint64_t)ids[K - 1] ^ WY64_P1, h ^ WY64_P2);
+    return wymix64(h, WY64_P3);
+}
+
+// Аналог hash_shingles для id: те же правила max_pos/K1/K2.
+inline std::size_t hash_shingles_ids(
+    const std::uint32_t* ids,
+    std::size_t n_tok,
+    std::size_t max_pos,
+    int K1, std::uint64_t* out1,
+    int K2 = 0, std::uint64_t* out2 = nullptr
+) {
+    std::size_t c1 = shingle_count(n_tok, K1);
+    std::size_t c2 = out2 ? shingle_count(n_tok, K2) : 0;
+    if (max_pos) { c1 = std::min(c1, max_pos); c2 = std::min(c2, max_pos); }
+
+    auto run = [&](int K, std::size_t c, std::uint64_t* out) {
+        switch (K) {
+        case 9:  for (std::size_t p = 0; p < c; ++p) out[p] = hash_shingle_ids_k<9>(ids + p);  break;
+        case 13: for (std::size_t p = 0; p < c; ++p) out[p] = hash_shingle_ids_k<13>(ids + p); break;
+        default: for (std::size_t p = 0; p < c; ++p) out[p] = hash_shingle_ids(ids + p, K);   break;
+        }
+    };
+    run(K1, c1, out1);
+    if (c2) run(K2, c2, out2);
+    return c1;
+}
+
+// ---- Winnowing (Schleimer, Wilkerson, Aiken) ----
+//
+// Из каждого окна в w подряд идущих шинглов берётся минимальный хэш; при
+// равенстве — самый правый, поэтому выбор не зависит от сдвига документа.
+// Позиция пишется, только если отличается от предыдущей выбранной.
+// Гарантия: общий фрагмент длиной >= w + K - 1 токенов даёт хотя бы один
+// общий отпечаток, при этом отпечатков ~2/(w+1) от числа шинглов.
+// Документ короче окна даёт один отпечаток (минимум по всем шинглам).
+//
+// sel и scratch — буферы вызывающего, ёмкость >= n. Возвращает число
+// выбранных позиций (по возрастанию) в sel.
+inline std::size_t winnow_positions(
+    const std::uint64_t* h,
+    std::size_t n,
+    int w,
+    std::uint32_t* sel,
+    std::uint32_t* scratch
+) {
+    if (n == 0) return 0;
+    const std::size_t win = std::min<std::size_t>(w > 0 ? (std::size_t)w : 1, n);
+
+    // монотонная очередь индексов: h возрастает строго от головы к хвосту
+    std::uint32_t* q = scratch;
+    std::size_t head = 0, tail = 0;
+    std::size_t out = 0;
+
+    for (std::size_t i = 0; i < n; ++i) {
+        while (tail > head && h[q[tail - 1]] >= h[i]) --tail;
+        q[tail++] = (std::uint32_t)i;
+
+        if (i + 1 < win) continue;
+        while (q[head] + win <= i) ++head;
+
+        const std::uint32_t m = q[head];
+        if (out == 0 || sel[out - 1] != m) sel[out++] = m;
+    }
+    return out;
+}
+
+inline std::size_t winnow_positions(
+    const std::uint64_t* h,
+    std::size_t n,
+    int w,
+    std::vector<std::uint32_t>& sel,
+    std::vector<std::uint32_t>& scratch
+) {
+    if (sel.size() < n) sel.resize(n);
+    if (scratch.size() < n) scratch.resize(n);
+    return winnow_positions(h, n, w, sel.data(), scratch.data());
+}
+
+// ---- Множество шинглов документа (дедупликация) ----
+//
+// Open addressing по mix64 с поколениями: begin() очищает множество за O(1)
+// сменой поколения, поэтому одна таблица переиспользуется всеми документами
+// потока. Ёмкость — степень двойки >= 2n, таблица только растёт.
+class ShingleDedupSet {
+public:
+    // Новый документ не больше чем из n шинглов.
+    void begin(std::size_t n) {
+        std::size_t cap = 64;
+        while (cap < 2 * n) cap <<= 1;
+        if (cap > keys_.size()) {
+            keys_.assign(cap, 0);
+            gens_.assign(cap, 0);
+            gen_ = 0;
+        }
+        mask_ = keys_.size() - 1;
+        if (++gen_ == 0) {  // переполнение поколения: честная очистка
+            std::fill(gens_.begin(), gens_.end(), 0u);
+            gen_ = 1;
+        }
+    }
+
+    // true, если h в документе впервые.
+    bool insert(std::uint64_t h) {
+        std::size_t i = (std::size_t)mix64(h) & mask_;
+        while (gens_[i] == gen_) {
+            if (keys_[i] == h) return false;
+            i = (i + 1) & mask_;
+        }
+        gens_[i] = gen_;
+        keys_[i] = h;
+        return true;
+    }
+
+private:
+    std::vector<std::uint64_t> keys_;
+    std::vector<std::uint32_t> gens_;
+    std::size_t   mask_ = 0;
+    std::uint32_t gen_  = 0;
+};
+
+// ---- Bottom-k скетч документа ----
+//
+// k наименьших различных значений mix64(хэш шингла), по возрастанию;
+// если различных шинглов меньше k, хвост заполнен SKETCH_EMPTY.
+// mix64 выравнивает распределение: сами шинглы — свёртка FNV.
+// Оценка Жаккара по двум скетчам — слияние <= 2k отсортированных u64.
+constexpr std::uint64_t SKETCH_EMPTY = ~0ull;
+
+// heap — буфер вызывающего, переиспользуется между документами.
+inline void bottomk_sketch(
+    const std::uint64_t* sh,
+    std::size_t n,
+    int k,
+    std::uint64_t* out,
+    std::vector<std::uint64_t>& heap
+) {
+    heap.clear();
+    const std::size_t kk = (std::size_t)k;
+    for (std::size_t i = 0; i < n; ++i) {
+        const std::uint64_t v = mix64(sh[i]);
+        if (v == SKETCH_EMPTY) continue;
+        if (heap.size() == kk && v >= heap.front()) continue;
+        // кандидатов мало (~k*ln(n/k)), линейная проверка дубликата дешёвая
+        if (std::find(heap.begin(), heap.end(), v) != heap.end()) continue;
+        if (heap.size() == kk) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = v;
+        } else {
+            heap.push_back(v);
+        }
+        std::push_heap(heap.begin(), heap.end());
+    }
+    std::sort_heap(heap.begin(), heap.end());
+    std::size_t j = 0;
+    for (; j < heap.size(); ++j) out[j] = heap[j];
+    for (; j < kk; ++j) out[j] = SKETCH_EMPTY;
+}
+
+// Оценка J(A, B): среди k наименьших значений объединения доля тех, что
+// есть в обоих скетчах. Пустые скетчи -> 0.
+inline double bottomk_jaccard(const std::uint64_t* a, const std::uint64_t* b, int k) {
+    int i = 0, j = 0, uni = 0, both = 0;
+    while (uni < k) {
+        const std::uint64_t x = (i < k) ? a[i] : SKETCH_EMPTY;
+        const std::uint64_t y = (j < k) ? b[j] : SKETCH_EMPTY;
+        if (x == SKETCH_EMPTY && y == SKETCH_EMPTY) break;
+        if (x == y)     { ++both; ++i; ++j; }
+        else if (x < y) { ++i; }
+        else            { ++j; }
+        ++uni;
+    }
+    return uni ? (double)both / (double)uni : 0.0;
+}
+
 inline std::uint64_t hash_shingle_tokens_spans(
-    const std::string& norm,
+    std::string_view norm,
     const std::vector<TokenSpan>& spans,
     int pos,
     int K
@@ -92,30 +1233,83 @@ inline std::uint64_t hash_shingle_tokens_spans(
     return h;
 }
 
-inline std::pair<std::uint64_t, std::uint64_t> simhash128_spans(
-    const std::string& norm,
-    const std::vector<TokenSpan>& spans
-) {
-    int acc1[64] = {0};
-    int acc2[64] = {0};
+// Вертикальные бит-срезанные счётчики: 64 счётчика (по одному на бит слова)
+// хранятся "поперёк" — plane[i] содержит i-й бит всех 64 счётчиков.
+// add() — это 4 шага and/xor без ветвлений (4-битный уровень, до 15
+// слов), раз в 15 слов уровень сливается в 32-битный.
+struct BitSlicedCounter64 {
+    std::uint64_t lo[4]  = {0, 0, 0, 0};
+    std::uint64_t hi[32] = {0};
+    unsigned pending = 0;
 
-    for (const auto& t : spans) {
-        const char* p = norm.data() + t.start;
-        std::size_t n = t.len;
+    void add(std::uint64_t x) {
+        std::uint64_t c = x, t;
+        t = lo[0] & c; lo[0] ^= c; c = t;
+        t = lo[1] & c; lo[1] ^= c; c = t;
+        t = lo[2] & c; lo[2] ^= c; c = t;
+        lo[3] ^= c;
+        if (++pending == 15) flush();
+    }
 
-        std::uint64_t h1 = fnv1a64(p, n);
-        std::uint64_t h2 = mix64(h1 ^ 0x9e3779b97f4a7c15ull);
+    void flush() {
+        std::uint64_t carry = 0;
+        for (int i = 0; i < 32; ++i) {
+            const std::uint64_t a = hi[i];
+            const std::uint64_t b = (i < 4) ? lo[i] : 0;
+            hi[i] = a ^ b ^ carry;
+            carry = (a & b) | (carry & (a ^ b));
+            if (i >= 3 && carry == 0) break;
+        }
+        lo[0] = lo[1] = lo[2] = lo[3] = 0;
+        pending = 0;
+    }
 
+    // Маска бит b, у которых единиц не меньше половины: 2*count >= n.
+    std::uint64_t majority_mask(std::uint64_t n) {
+        flush();
+        std::uint64_t m = 0;
         for (int b = 0; b < 64; ++b) {
-            acc1[b] += ((h1 >> b) & 1ull) ? 1 : -1;
-            acc2[b] += ((h2 >> b) & 1ull) ? 1 : -1;
+            std::uint64_t cnt = 0;
+            for (int i = 0; i < 32; ++i) cnt |= ((hi[i] >> b) & 1ull) << i;
+            if (2 * cnt >= n) m |= (1ull << b);
         }
+        return m;
     }
+};
 
-    std::uint64_t hi = 0, lo = 0;
-    for (int b = 0; b < 64; ++b) {
-        if (acc1[b] >= 0) hi |= (1ull << b);
-        if (acc2[b] >= 0) lo |= (1ull << b);
+// Аккумулятор simhash128: acc[b] += bit ? 1 : -1 эквивалентно
+// acc[b] = 2*count1[b] - n, поэтому достаточно считать единицы.
+struct Simhash128Acc {
+    BitSlicedCounter64 c1;
+    BitSlicedCounter64 c2;
+    std::uint64_t n = 0;
+
+    void add(std::uint64_t h1) {
+        c1.add(h1);
+        c2.add(mix64(h1 ^ 0x9e3779b97f4a7c15ull));
+        ++n;
     }
-    return {hi, lo};
+
+    std::pair<std::uint64_t, std::uint64_t> finish() {
+        return {c1.majority_mask(n), c2.majority_mask(n)};
+    }
+};
+
+inline std::pair<std::uint64_t, std::uint64_t> simhash128_spans(
+    std::string_view norm,
+    const std::vector<TokenSpan>& spans
+) {
+    Simhash128Acc acc;
+    for (const auto& t : spans) acc.add(fnv1a64(norm.data() + t.start, t.len));
+    return acc.finish();
+}
+
+// simhash128 по готовым хэшам токенов, см. hash_tokens_fused.
+inline std::pair<std::uint64_t, std::uint64_t> simhash128_token_hashes(
+    const std::uint64_t* th,
+    std::size_t n
+) {
+    Simhash128Acc acc;
+    for (std::size_t i = 0; i < n; ++i) acc.add(th[i]);
+    return acc.finish();
 }
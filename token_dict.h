@@ -0,0 +1,228 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "text_common.h"
+
+// Словарь токенов (interning): нормализованный токен -> плотный u32 id.
+//
+// Ключ — хэш токена в семействе индекса (см. HashFamily): builder уже
+// считает его в hash_tokens_fused, а 64 бита дают пренебрежимо малую
+// вероятность склейки двух слов на словарях в миллионы токенов.
+// Текст токена сохраняется по первому вхождению — для статистики словаря.
+//
+// Файл index_native_dict.bin (little-endian):
+//   magic "PDIC", u32 version, u32 norm_mode, u32 hash_family,
+//   u32 n_tokens, u32 reserved, u64 pool_bytes,
+//   TokenDictEntry[n_tokens] (в порядке id), pool[pool_bytes].
+
+constexpr char          TOKEN_DICT_MAGIC[4]  = {'P', 'D', 'I', 'C'};
+constexpr std::uint32_t TOKEN_DICT_VERSION   = 1;
+constexpr std::uint32_t TOKEN_ID_UNKNOWN     = 0xFFFFFFFFu;
+
+struct TokenDictEntry {
+    std::uint64_t token_hash = 0;
+    std::uint64_t cf         = 0;   // вхождений в корпусе
+    std::uint32_t df         = 0;   // документов с токеном
+    std::uint32_t str_len    = 0;
+    std::uint64_t str_off    = 0;   // смещение в pool
+};
+static_assert(sizeof(TokenDictEntry) == 32, "TokenDictEntry is part of the on-disk format");
+
+class TokenDict {
+public:
+    std::uint32_t size() const { return (std::uint32_t)entries_.size(); }
+    const std::vector<TokenDictEntry>& entries() const { return entries_; }
+    const std::string& pool() const { return pool_; }
+
+    std::string token_text(std::uint32_t id) const {
+        const auto& e = entries_[id];
+        return pool_.substr((std::size_t)e.str_off, e.str_len);
+    }
+
+    // id по хэшу токена или TOKEN_ID_UNKNOWN (путь запроса).
+    std::uint32_t lookup(std::uint64_t token_hash) const {
+        if (slots_.empty()) return TOKEN_ID_UNKNOWN;
+        std::size_t i = slot_of(token_hash);
+        while (true) {
+            const std::uint32_t id = slots_[i];
+            if (id == TOKEN_ID_UNKNOWN) return TOKEN_ID_UNKNOWN;
+            if (entries_[id].token_hash == token_hash) return id;
+            i = (i + 1) & mask_;
+        }
+    }
+
+    // Интернирует все токены документа doc_idx. Текст нового токена берётся
+    // из сырого текста по span и нормализуется (только при первом вхождении).
+    void intern_doc(
+        std::uint32_t doc_idx,
+        const char* raw,
+        const std::uint64_t* tok_hashes,
+        const TokenSpan* spans,
+        std::size_t n,
+        NormMode norm,
+        std::vector<std::uint32_t>& ids
+    ) {
+        ids.resize(n);
+        for (std::size_t t = 0; t < n; ++t) {
+            const std::uint64_t h = tok_hashes[t];
+            std::uint32_t id = find_or_insert(h);
+            if (id == entries_.size()) {
+                const std::string tok = normalize_for_shingles(
+                    std::string_view(raw + spans[t].start, spans[t].len), norm);
+                TokenDictEntry e;
+                e.token_hash = h;
+                e.str_off    = pool_.size();
+                e.str_len    = (std::uint32_t)tok.size();
+                pool_ += tok;
+                entries_.push_back(e);
+                last_doc_.push_back(TOKEN_ID_UNKNOWN);
+            }
+            TokenDictEntry& e = entries_[id];
+            e.cf++;
+            if (last_doc_[id] != doc_idx) { last_doc_[id] = doc_idx; e.df++; }
+            ids[t] = id;
+        }
+    }
+
+    // Сливает словарь батча (intern_doc по его документам с локальными
+    // номерами): новые токены получают id в порядке первого вхождения в
+    // батче, cf и df складываются — документы батчей не пересекаются. Батчи,
+    // слитые по порядку, дают те же id, что intern_doc по документам подряд.
+    // to_global[локальный id] — id в этом словаре.
+    void merge(const TokenDict& batch, std::vector<std::uint32_t>& to_global) {
+        to_global.resize(batch.entries_.size());
+        for (std::uint32_t l = 0; l < (std::uint32_t)batch.entries_.size(); ++l) {
+            const TokenDictEntry& b = batch.entries_[l];
+            const std::uint32_t id = find_or_insert(b.token_hash);
+            if (id == entries_.size()) {
+                TokenDictEntry e;
+                e.token_hash = b.token_hash;
+                e.str_off    = pool_.size();
+                e.str_len    = b.str_len;
+                pool_.append(batch.pool_, (std::size_t)b.str_off, b.str_len);
+                entries_.push_back(e);
+                last_doc_.push_back(TOKEN_ID_UNKNOWN);
+            }
+            entries_[id].cf += b.cf;
+            entries_[id].df += b.df;
+            to_global[l] = id;
+        }
+    }
+
+    // Пустой словарь; таблица слотов остаётся выделенной (словарь батча).
+    void clear() {
+        entries_.clear();
+        last_doc_.clear();
+        pool_.clear();
+        std::fill(slots_.begin(), slots_.end(), TOKEN_ID_UNKNOWN);
+    }
+
+    bool write(const std::string& path, TextParams tp, std::string& err) const {
+        std::ofstream out(path, std::ios::binary);
+        if (!out) { err = "cannot open " + path + " for write"; return false; }
+
+        const std::uint32_t version   = TOKEN_DICT_VERSION;
+        const std::uint32_t norm_mode = (std::uint32_t)tp.norm;
+        const std::uint32_t hash_fam  = (std::uint32_t)tp.hash;
+        const std::uint32_t n_tokens  = size();
+        const std::uint32_t reserved  = 0;
+        const std::uint64_t pool_bytes = pool_.size();
+
+        out.write(TOKEN_DICT_MAGIC, 4);
+        out.write((const char*)&version,    sizeof(version));
+        out.write((const char*)&norm_mode,  sizeof(norm_mode));
+        out.write((const char*)&hash_fam,   sizeof(hash_fam));
+        out.write((const char*)&n_tokens,   sizeof(n_tokens));
+        out.write((const char*)&reserved,   sizeof(reserved));
+        out.write((const char*)&pool_bytes, sizeof(pool_bytes));
+        out.write((const char*)entries_.data(), (std::streamsize)(entries_.size() * sizeof(TokenDictEntry)));
+        out.write(pool_.data(), (std::streamsize)pool_.size());
+        if (!out) { err = "write failed: " + path; return false; }
+        return true;
+    }
+
+    bool read(const std::string& path, TextParams& tp, std::string& err) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) { err = "cannot open " + path; return false; }
+
+        char magic[4] = {0, 0, 0, 0};
+        std::uint32_t version = 0, norm_mode = 0, hash_fam = 0, n_tokens = 0, reserved = 0;
+        std::uint64_t pool_bytes = 0;
+        in.read(magic, 4);
+        in.read((char*)&version,    sizeof(version));
+        in.read((char*)&norm_mode,  sizeof(norm_mode));
+        in.read((char*)&hash_fam,   sizeof(hash_fam));
+        in.read((char*)&n_tokens,   sizeof(n_tokens));
+        in.read((char*)&reserved,   sizeof(reserved));
+        in.read((char*)&pool_bytes, sizeof(pool_bytes));
+        if (!in || std::memcmp(magic, TOKEN_DICT_MAGIC, 4) != 0) { err = "bad dict header"; return false; }
+        if (version != TOKEN_DICT_VERSION) { err = "unsupported dict version " + std::to_string(version); return false; }
+
+        entries_.assign(n_tokens, TokenDictEntry{});
+        pool_.assign((std::size_t)pool_bytes, '\0');
+        in.read((char*)entries_.data(), (std::streamsize)(entries_.size() * sizeof(TokenDictEntry)));
+        in.read(&pool_[0], (std::streamsize)pool_.size());
+        if (!in) { err = "truncated dict"; return false; }
+
+        tp.norm = (NormMode)norm_mode;
+        tp.hash = (HashFamily)hash_fam;
+
+        last_doc_.clear();
+        slots_.clear();
+        rehash(entries_.size());
+        return true;
+    }
+
+private:
+    std::vector<TokenDictEntry> entries_;
+    std::vector<std::uint32_t>  last_doc_;  // только во время сборки: для df
+    std::string                 pool_;
+    std::vector<std::uint32_t>  slots_;     // open addressing: id или UNKNOWN
+    std::size_t                 mask_ = 0;
+
+    std::size_t slot_of(std::uint64_t h) const { return (std::size_t)mix64(h) & mask_; }
+
+    // Возвращает id; для нового хэша — size() (запись добавляет вызывающий).
+    std::uint32_t find_or_insert(std::uint64_t h) {
+        if ((entries_.size() + 1) * 2 > slots_.size()) rehash(entries_.size() + 1);
+        std::size_t i = slot_of(h);
+        while (true) {
+            const std::uint32_t id = slots_[i];
+            if (id == TOKEN_ID_UNKNOWN) {
+                slots_[i] = (std::uint32_t)entries_.size();
+                return slots_[i];
+            }
+            if (entries_[id].token_hash == h) return id;
+            i = (i + 1) & mask_;
+        }
+    }
+
+    void rehash(std::size_t need) {
+        std::size_t cap = 1024;
+        while (cap < need * 2) cap <<= 1;
+        slots_.assign(cap, TOKEN_ID_UNKNOWN);
+        mask_ = cap - 1;
+        for (std::uint32_t id = 0; id < (std::uint32_t)entries_.size(); ++id) {
+            std::size_t i = slot_of(entries_[id].token_hash);
+            while (slots_[i] != TOKEN_ID_UNKNOWN) i = (i + 1) & mask_;
+            slots_[i] = id;
+        }
+    }
+};
+
+// Путь запроса: хэши токенов -> id по словарю индекса. Неизвестные токены
+// получают TOKEN_ID_UNKNOWN: шинглы с ними в индексе не встречаются.
+inline void lookup_token_ids(
+    const TokenDict& dict,
+    const std::uint64_t* tok_hashes,
+    std::size_t n,
+    std::vector<std::uint32_t>& ids
+) {
+    ids.resize(n);
+    for (std::size_t t = 0; t < n; ++t) ids[t] = dict.lookup(tok_hashes[t]);
+}